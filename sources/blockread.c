@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Block read ahead
+ *
+ * Blocks are read in place from the mapping of the block store, a block
+ * not in the page cache stalls the interpreter on a page fault. loads
+ * asks for its whole range up front: the kernel is told it will be
+ * needed and reads it in the background while the first blocks run.
+ * Running a block faults on its own pages only, which wait for their
+ * read if it hasn't landed yet.
+ *
+ * Nothing is cancelled: a loads nested in another one only adds its own
+ * range to what is already being read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "colorforth.h"
+
+static bool is_enabled = true;
+
+// Tell the kernel about a run of stored bytes, -1 if it can't be read
+static int
+advise(const int fd, const uint64_t offset, const uint64_t size)
+{
+	return posix_fadvise(fd, offset, size, POSIX_FADV_WILLNEED) ? -1 : 0;
+}
+
+/*
+ * Called from the interpreter
+ */
+void
+block_prefetch_enable(const bool enabled)
+{
+	is_enabled = enabled;
+}
+
+// Start reading blocks first to last, every step, of the block store
+void
+block_prefetch(const cell_t first, const cell_t last, const cell_t step)
+{
+	const char *path = block_store_path();
+	uint64_t offset, start = 0, end = 0;
+	uint32_t size;
+	cell_t nb_blocks;
+	int fd;
+
+	if (!is_enabled || !path || step < 1 || first > last)
+		return;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return;
+
+	nb_blocks = block_count();
+
+	// Neighbouring extents are asked for at once
+	for (cell_t n = first < 0 ? 0 : first; n <= last && n < nb_blocks; n += step)
+	{
+		// Empty blocks aren't stored, there is nothing to read
+		if (block_extent(n, &offset, &size) == -1)
+			continue;
+
+		if (end > start && offset >= start && offset <= end)
+		{
+			if (offset + size > end)
+				end = offset + size;
+			continue;
+		}
+
+		if (end > start && advise(fd, start, end - start) == -1)
+			break;
+
+		start = offset;
+		end   = offset + size;
+	}
+
+	if (end > start)
+		(void)advise(fd, start, end - start);
+
+	close(fd);
+}
@@ -0,0 +1,904 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Block store
+ *
+ * Blocks come either from a raw blocks.cf, an array of 1 KiB blocks, or
+ * from a container:
+ *
+ *   header   magic, version, number of blocks, CRC32C of the index and
+ *            a hash of the whole content
+ *   index    for each block, offset and size of its cells and their CRC32C
+ *   cells    blocks without their trailing zero cells, empty ones have
+ *            no cells at all
+ *
+ * Both are mapped and read in place. Only the index is checked when the
+ * file is opened, a block is checked the first time it is read.
+ *
+ * Since version 2, a block can be compressed on its own, which is flagged
+ * in its size. It is decompressed into a cache the first time it is read.
+ *
+ * A watched file is mapped again when it is written, blocks whose hash
+ * changed are reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "colorforth.h"
+
+#define BLOCK_STORE_MAGIC   "cfbk"
+#define BLOCK_STORE_VERSION 2
+
+#define BLOCK_COMPRESSED    0x80000000	// In the size of an index entry
+#define BLOCK_BYTES         (BLOCK_CELLS * sizeof(cell_t))
+#define COMPRESSED_MAX      (BLOCK_BYTES + BLOCK_CELLS / 64)
+
+#define HASH_OFFSET 0xcbf29ce484222325ULL	// FNV-1a 64 bits
+#define HASH_PRIME  0x100000001b3ULL
+
+struct block_store_header
+{
+	char     magic[4];
+	uint32_t version;
+	uint32_t nb_blocks;
+	uint32_t index_crc;
+	uint64_t content_hash;	// Of the blocks padded to 256 cells
+};
+
+struct block_index_entry
+{
+	uint64_t offset;	// From the start of the file
+	uint32_t size;		// In bytes, as stored
+	uint32_t crc;		// Of the bytes as stored
+};
+
+struct decoded_block
+{
+	cell_t       cells[BLOCK_CELLS];
+	unsigned int nb_cells;
+};
+
+enum block_check
+{
+	BLOCK_UNCHECKED,
+	BLOCK_VALID,
+	BLOCK_CORRUPTED
+};
+
+static const cell_t empty_block[BLOCK_CELLS];
+
+struct block_store
+{
+	char                           *path;
+	void                           *map;
+	size_t                          size;
+	const struct block_store_header *header;	// NULL for a raw file
+	const struct block_index_entry  *index;
+	uint8_t                        *checks;
+	struct decoded_block           **decoded;	// Compressed blocks read so far
+	cell_t                          nb_blocks;
+	uint64_t                        content_hash;
+	bool                            is_hashed;
+	uint64_t                       *hashes;		// Of each block, when watched
+};
+
+static struct block_store store;
+
+static int  watch_fd = -1;
+static char *watch_name;	// Of the file in its directory
+
+/*
+ * CRC32C, with the SSE 4.2 instruction when the processor has it
+ */
+static uint32_t crc32c_table[256];
+
+static uint32_t
+crc32c_software(uint32_t crc, const uint8_t *data, size_t length)
+{
+	if (!crc32c_table[1])
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+
+			for (int k = 0; k < 8; k++)
+				c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+
+			crc32c_table[i] = c;
+		}
+	}
+
+	while (length--)
+		crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hardware(uint32_t crc, const uint8_t *data, size_t length)
+{
+	uint64_t crc64 = crc;
+	uint64_t chunk;
+
+	for (; length >= 8; length -= 8, data += 8)
+	{
+		memcpy(&chunk, data, 8);
+		crc64 = _mm_crc32_u64(crc64, chunk);
+	}
+
+	crc = crc64;
+
+	while (length--)
+		crc = _mm_crc32_u8(crc, *data++);
+
+	return crc;
+}
+#endif
+
+uint32_t
+crc32c(const void *data, const size_t length)
+{
+	static uint32_t (*implementation)(uint32_t, const uint8_t *, size_t);
+
+	if (!implementation)
+	{
+		implementation = crc32c_software;
+#if defined(__x86_64__)
+		if (__builtin_cpu_supports("sse4.2"))
+			implementation = crc32c_hardware;
+#endif
+	}
+
+	return ~implementation(~0U, data, length);
+}
+
+static uint64_t
+hash_cells(uint64_t hash, const cell_t *cells, const size_t nb_cells)
+{
+	for (size_t i = 0; i < nb_cells; i++)
+		hash = (hash ^ (uint32_t)cells[i]) * HASH_PRIME;
+
+	return hash;
+}
+
+/*
+ * Block codec
+ *
+ * Blocks are mostly zero cells and words repeated within the block, so
+ * the stream is made of cell runs, each starting with a byte:
+ *
+ *   0nnnnnnn            n + 1 literal cells follow
+ *   10nnnnnn            n + 1 zero cells
+ *   11nnnnnn dddddddd   copy n + 1 cells from d + 1 cells back
+ *
+ * Copying a single cell takes half its size, which pays off for the words
+ * used over and over in a block.
+ */
+#define RUN_LITERAL 0x00
+#define RUN_ZEROS   0x80
+#define RUN_COPY    0xc0
+
+static size_t
+compress_block(const cell_t *cells, const unsigned int nb_cells, uint8_t *out)
+{
+	size_t size = 0;
+	size_t literal = 0;	// Where the pending literal run starts in out
+	unsigned int nb_literals = 0;
+	unsigned int i = 0;
+
+	while (i < nb_cells)
+	{
+		unsigned int length = 0;
+		unsigned int distance = 0;
+
+		if (!cells[i])
+		{
+			while (i + length < nb_cells && !cells[i + length] && length < 64)
+				length++;
+		}
+		else
+		{
+			for (unsigned int d = 1; d <= 256 && d <= i; d++)
+			{
+				unsigned int l = 0;
+
+				while (i + l < nb_cells && l < 64 && cells[i + l] == cells[i + l - d])
+					l++;
+
+				if (l > length)
+				{
+					length = l;
+					distance = d;
+				}
+			}
+		}
+
+		if (length)
+		{
+			nb_literals = 0;
+
+			if (!cells[i])
+				out[size++] = RUN_ZEROS | (length - 1);
+			else
+			{
+				out[size++] = RUN_COPY | (length - 1);
+				out[size++] = distance - 1;
+			}
+
+			i += length;
+			continue;
+		}
+
+		if (nb_literals == 0 || nb_literals == 128)
+		{
+			literal = size++;
+			nb_literals = 0;
+		}
+
+		out[literal] = RUN_LITERAL | nb_literals++;
+		memcpy(&out[size], &cells[i++], sizeof(cell_t));
+		size += sizeof(cell_t);
+	}
+
+	return size;
+}
+
+static int
+decompress_block(const uint8_t *in, const size_t size, struct decoded_block *block)
+{
+	const uint8_t *end = in + size;
+	unsigned int n = 0;
+
+	while (in < end)
+	{
+		unsigned int run = *in++;
+		unsigned int length;
+
+		if (!(run & 0x80))
+		{
+			length = (run & 0x7f) + 1;
+
+			if (n + length > BLOCK_CELLS || (size_t)(end - in) < length * sizeof(cell_t))
+				return -1;
+
+			memcpy(&block->cells[n], in, length * sizeof(cell_t));
+			in += length * sizeof(cell_t);
+		}
+		else if ((run & RUN_COPY) == RUN_ZEROS)
+		{
+			length = (run & 0x3f) + 1;
+
+			if (n + length > BLOCK_CELLS)
+				return -1;
+
+			memset(&block->cells[n], 0, length * sizeof(cell_t));
+		}
+		else
+		{
+			unsigned int distance;
+
+			length = (run & 0x3f) + 1;
+
+			if (in == end || n + length > BLOCK_CELLS || (distance = *in++ + 1) > n)
+				return -1;
+
+			// Overlapping copies repeat the last cells
+			for (unsigned int i = 0; i < length; i++)
+				block->cells[n + i] = block->cells[n + i - distance];
+		}
+
+		n += length;
+	}
+
+	block->nb_cells = n;
+
+	return 0;
+}
+
+/*
+ * Reading
+ */
+static int
+open_container(const char *path)
+{
+	const struct block_store_header *header = store.map;
+	size_t index_size;
+
+	if (header->version < 1 || header->version > BLOCK_STORE_VERSION)
+	{
+		fprintf(stderr, "Error: %s: unknown block store version %u!\n",
+				path, header->version);
+		return -1;
+	}
+
+	index_size = (size_t)header->nb_blocks * sizeof(struct block_index_entry);
+
+	if (index_size > store.size - sizeof(*header))
+	{
+		fprintf(stderr, "Error: %s: truncated block index!\n", path);
+		return -1;
+	}
+
+	store.header = header;
+	store.index  = (const struct block_index_entry *)(header + 1);
+
+	if (crc32c(store.index, index_size) != header->index_crc)
+	{
+		fprintf(stderr, "Error: %s: corrupted block index!\n", path);
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < header->nb_blocks; i++)
+	{
+		const struct block_index_entry *entry = &store.index[i];
+		uint32_t size = entry->size & ~BLOCK_COMPRESSED;
+		bool is_compressed = entry->size & BLOCK_COMPRESSED;
+
+		if ((is_compressed ? size > COMPRESSED_MAX || header->version < 2
+					: size > BLOCK_BYTES || size % sizeof(cell_t))
+				|| entry->offset % sizeof(cell_t)
+				|| entry->offset > store.size
+				|| size > store.size - entry->offset)
+		{
+			fprintf(stderr, "Error: %s: block %u out of the file!\n", path, i);
+			return -1;
+		}
+	}
+
+	store.nb_blocks    = header->nb_blocks;
+	store.content_hash = header->content_hash;
+	store.is_hashed    = true;
+
+	return 0;
+}
+
+static void
+release_store(struct block_store *released)
+{
+	if (released->map)
+		munmap(released->map, released->size);
+
+	for (cell_t n = 0; released->decoded && n < released->nb_blocks; n++)
+		free(released->decoded[n]);
+
+	free(released->decoded);
+	free(released->checks);
+	free(released->hashes);
+	free(released->path);
+	memset(released, 0, sizeof(*released));
+}
+
+static int
+map_store(const char *path)
+{
+	struct stat sbuf;
+	int fd;
+	int status = 0;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+	{
+		perror(path);
+		return -1;
+	}
+
+	if (fstat(fd, &sbuf) == -1)
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	store.size = sbuf.st_size;
+	store.map  = store.size ? mmap(0, store.size, PROT_READ, MAP_SHARED, fd, 0)
+		: NULL;
+	close(fd);
+
+	if (store.map == MAP_FAILED)
+	{
+		perror(path);
+		store.map = NULL;
+		return -1;
+	}
+
+	if (store.size >= sizeof(struct block_store_header)
+			&& !memcmp(store.map, BLOCK_STORE_MAGIC, 4))
+		status = open_container(path);
+	else
+		store.nb_blocks = store.size / (BLOCK_CELLS * sizeof(cell_t));
+
+	if (status == 0 && (!(store.checks = calloc(store.nb_blocks + 1, 1))
+			|| !(store.decoded = calloc(store.nb_blocks + 1, sizeof(*store.decoded)))
+			|| !(store.path = strdup(path))))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (status == -1)
+		release_store(&store);
+
+	return status;
+}
+
+int
+block_store_open(const char *path)
+{
+	block_store_close();
+
+	return map_store(path);
+}
+
+void
+block_store_close(void)
+{
+	release_store(&store);
+	xref_clear();
+}
+
+cell_t
+block_count(void)
+{
+	return store.nb_blocks;
+}
+
+/*
+ * Cells of block n, at most BLOCK_CELLS of them. Blocks past the end and
+ * corrupted ones read as empty.
+ */
+const cell_t *
+block_cells(const cell_t n, unsigned int *nb_cells)
+{
+	const struct block_index_entry *entry;
+	struct decoded_block *decoded, *expected = NULL;
+
+	*nb_cells = 0;
+
+	if (n < 0 || n >= store.nb_blocks)
+		return empty_block;
+
+	if (!store.header)
+	{
+		*nb_cells = BLOCK_CELLS;
+		return (const cell_t *)store.map + (size_t)n * BLOCK_CELLS;
+	}
+
+	if (block_verify(n) == -1)
+		return empty_block;
+
+	entry = &store.index[n];
+
+	if (!(entry->size & BLOCK_COMPRESSED))
+	{
+		*nb_cells = entry->size / sizeof(cell_t);
+		return (const cell_t *)((const char *)store.map + entry->offset);
+	}
+
+	if (!(decoded = __atomic_load_n(&store.decoded[n], __ATOMIC_ACQUIRE)))
+	{
+		if (!(decoded = malloc(sizeof(struct decoded_block))))
+		{
+			fprintf(stderr, "Error: Not enough memory!\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (decompress_block((const uint8_t *)store.map + entry->offset,
+					entry->size & ~BLOCK_COMPRESSED, decoded) == -1)
+		{
+			fprintf(stderr, "Error: block %d is corrupted!\n", n);
+			decoded->nb_cells = 0;
+		}
+
+		// The editor and the interpreter thread may both decode it
+		if (!__atomic_compare_exchange_n(&store.decoded[n], &expected, decoded,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			free(decoded);
+			decoded = expected;
+		}
+	}
+
+	*nb_cells = decoded->nb_cells;
+
+	return decoded->cells;
+}
+
+int
+block_verify(const cell_t n)
+{
+	const struct block_index_entry *entry;
+	uint8_t check;
+
+	if (n < 0 || n >= store.nb_blocks || !store.header)
+		return 0;
+
+	// The editor and the interpreter thread may both check it, alike
+	check = __atomic_load_n(&store.checks[n], __ATOMIC_RELAXED);
+
+	if (check == BLOCK_UNCHECKED)
+	{
+		entry = &store.index[n];
+		check = crc32c((const char *)store.map + entry->offset,
+				entry->size & ~BLOCK_COMPRESSED) == entry->crc
+			? BLOCK_VALID : BLOCK_CORRUPTED;
+
+		if (__atomic_exchange_n(&store.checks[n], check, __ATOMIC_RELAXED)
+				== BLOCK_UNCHECKED && check == BLOCK_CORRUPTED)
+			fprintf(stderr, "Error: block %d is corrupted!\n", n);
+	}
+
+	return check == BLOCK_VALID ? 0 : -1;
+}
+
+const char *
+block_store_path(void)
+{
+	return store.path;
+}
+
+// Where the stored bytes of block n are in the file, -1 when it has none
+int
+block_extent(const cell_t n, uint64_t *offset, uint32_t *size)
+{
+	if (n < 0 || n >= store.nb_blocks)
+		return -1;
+
+	if (!store.header)
+	{
+		*offset = (uint64_t)n * BLOCK_BYTES;
+		*size   = BLOCK_BYTES;
+		return 0;
+	}
+
+	*offset = store.index[n].offset;
+	*size   = store.index[n].size & ~BLOCK_COMPRESSED;
+
+	return *size ? 0 : -1;
+}
+
+/*
+ * Hash of the blocks padded to 256 cells, the same for a raw file and
+ * its container. Raw files are hashed on first use.
+ */
+uint64_t
+block_store_hash(void)
+{
+	if (!store.is_hashed)
+	{
+		store.content_hash = hash_cells(HASH_OFFSET, store.map,
+				(size_t)store.nb_blocks * BLOCK_CELLS);
+		store.is_hashed = true;
+	}
+
+	return store.content_hash;
+}
+
+/*
+ * Watching
+ *
+ * The directory is watched rather than the file, tools often write a new
+ * file and rename it over the old one.
+ */
+static uint64_t
+block_hash(const cell_t n)
+{
+	const struct block_index_entry *entry;
+
+	if (!store.header)
+		return hash_cells(HASH_OFFSET,
+				(const cell_t *)store.map + (size_t)n * BLOCK_CELLS, BLOCK_CELLS);
+
+	// Containers already have a checksum of each block in their index
+	entry = &store.index[n];
+
+	return ((uint64_t)entry->crc << 32) | entry->size;
+}
+
+static void
+hash_blocks(void)
+{
+	if (!(store.hashes = malloc((store.nb_blocks + 1) * sizeof(uint64_t))))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (cell_t n = 0; n < store.nb_blocks; n++)
+		store.hashes[n] = block_hash(n);
+}
+
+void
+block_store_unwatch(void)
+{
+	if (watch_fd != -1)
+		close(watch_fd);
+
+	free(watch_name);
+	watch_fd   = -1;
+	watch_name = NULL;
+}
+
+int
+block_store_watch(void)
+{
+	char *directory, *copy;
+
+	if (!store.path || watch_fd != -1)
+		return -1;
+
+	if ((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+	{
+		perror("inotify_init1");
+		return -1;
+	}
+
+	// dirname() and basename() may modify their argument
+	if (!(directory = strdup(store.path)) || !(copy = strdup(store.path))
+			|| !(watch_name = strdup(basename(copy))))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	free(copy);
+
+	if (inotify_add_watch(watch_fd, dirname(directory),
+				IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+	{
+		perror(store.path);
+		block_store_unwatch();
+		free(directory);
+		return -1;
+	}
+
+	free(directory);
+	hash_blocks();
+
+	return 0;
+}
+
+/*
+ * Map the watched file again if it was written since the last call, and
+ * report each block that differs. Returns the number of changed blocks,
+ * or -1 if the new file can't be read, the old one is kept then.
+ */
+int
+block_store_poll(void (*changed)(const cell_t n))
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct block_store previous;
+	bool is_written = false;
+	cell_t nb_blocks;
+	ssize_t length;
+	int nb_changed = 0;
+
+	if (watch_fd == -1)
+		return 0;
+
+	while ((length = read(watch_fd, events, sizeof(events))) > 0)
+	{
+		for (char *p = events; p < events + length;
+				p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+		{
+			struct inotify_event *event = (struct inotify_event *)p;
+
+			if (event->len && !strcmp(event->name, watch_name))
+				is_written = true;
+		}
+	}
+
+	if (length == -1 && errno != EAGAIN)
+		perror("inotify");
+
+	if (!is_written)
+		return 0;
+
+	previous = store;
+	memset(&store, 0, sizeof(store));
+
+	// The cross references of the blocks that didn't change are kept
+	if (map_store(previous.path) == -1)
+	{
+		store = previous;
+		return -1;
+	}
+
+	hash_blocks();
+	nb_blocks = store.nb_blocks > previous.nb_blocks ? store.nb_blocks
+		: previous.nb_blocks;
+
+	for (cell_t n = 0; n < nb_blocks; n++)
+	{
+		if (n < store.nb_blocks && n < previous.nb_blocks
+				&& store.hashes[n] == previous.hashes[n])
+			continue;
+
+		nb_changed++;
+		xref_update(n);
+
+		if (changed)
+			changed(n);
+	}
+
+	release_store(&previous);
+
+	return nb_changed;
+}
+
+/*
+ * Writing, blocks are compressed when asked and when it makes them smaller
+ */
+int
+block_store_save(const char *path, const cell_t *cells, const cell_t nb_blocks,
+		const bool compress)
+{
+	struct block_store_header header = {.magic = BLOCK_STORE_MAGIC,
+		.version = compress ? 2 : 1, .nb_blocks = nb_blocks};
+	struct block_index_entry *index;
+	uint8_t *data;
+	size_t size = 0;
+	uint64_t start;
+	FILE *file;
+	int status = 0;
+
+	index = calloc(nb_blocks + 1, sizeof(*index));
+	data  = malloc((size_t)nb_blocks * (COMPRESSED_MAX + sizeof(cell_t)) + 1);
+
+	if (!index || !data)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	start = sizeof(header) + (uint64_t)nb_blocks * sizeof(*index);
+	header.content_hash = hash_cells(HASH_OFFSET, cells,
+			(size_t)nb_blocks * BLOCK_CELLS);
+
+	for (cell_t n = 0; n < nb_blocks; n++)
+	{
+		const cell_t *block = &cells[(size_t)n * BLOCK_CELLS];
+		unsigned int used = BLOCK_CELLS;
+		size_t stored = 0;
+
+		while (used && !block[used - 1])
+			used--;
+
+		if (compress && used)
+			stored = compress_block(block, used, &data[size]);
+
+		if (stored && stored < used * sizeof(cell_t))
+			index[n].size = stored | BLOCK_COMPRESSED;
+		else
+		{
+			stored = used * sizeof(cell_t);
+			memcpy(&data[size], block, stored);
+			index[n].size = stored;
+		}
+
+		index[n].offset = used ? start + size : 0;
+		index[n].crc    = crc32c(&data[size], stored);
+
+		// Keep the next block aligned on a cell
+		while (stored % sizeof(cell_t))
+			data[size + stored++] = 0;
+
+		size += stored;
+	}
+
+	header.index_crc = crc32c(index, nb_blocks * sizeof(*index));
+
+	if (!(file = fopen(path, "wb")))
+	{
+		perror(path);
+		free(index);
+		free(data);
+		return -1;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1
+			|| fwrite(index, sizeof(*index), nb_blocks, file) != (size_t)nb_blocks
+			|| fwrite(data, 1, size, file) != size)
+		status = -1;
+
+	if (fclose(file) == EOF || status == -1)
+	{
+		perror(path);
+		status = -1;
+	}
+
+	free(index);
+	free(data);
+
+	return status;
+}
+
+/*
+ * Replace block n in the file, which is extended when n is past its end.
+ * A raw file is written in place, a container is saved aside then renamed
+ * over the old one. The store sees the new cells on the next poll.
+ */
+int
+block_store_write(const cell_t n, const cell_t *cells, const unsigned int nb_cells)
+{
+	cell_t block[BLOCK_CELLS] = {0};
+	cell_t nb_blocks = n < store.nb_blocks ? store.nb_blocks : n + 1;
+	const cell_t *old;
+	unsigned int nb_old;
+	cell_t *blocks;
+	char *temporary;
+	int fd, status = 0;
+
+	if (!store.path || n < 0 || nb_cells > BLOCK_CELLS)
+		return -1;
+
+	memcpy(block, cells, nb_cells * sizeof(cell_t));
+
+	if (!store.header)
+	{
+		if ((fd = open(store.path, O_WRONLY)) == -1
+				|| pwrite(fd, block, BLOCK_BYTES, (off_t)n * BLOCK_BYTES)
+					!= (ssize_t)BLOCK_BYTES)
+			status = -1;
+
+		if ((fd != -1 && close(fd) == -1) || status == -1)
+		{
+			perror(store.path);
+			status = -1;
+		}
+
+		return status;
+	}
+
+	blocks    = calloc((size_t)nb_blocks * BLOCK_CELLS + 1, sizeof(cell_t));
+	temporary = malloc(strlen(store.path) + sizeof(".new"));
+
+	if (!blocks || !temporary)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (cell_t i = 0; i < store.nb_blocks; i++)
+	{
+		old = block_cells(i, &nb_old);
+		memcpy(&blocks[(size_t)i * BLOCK_CELLS], old, nb_old * sizeof(cell_t));
+	}
+
+	memcpy(&blocks[(size_t)n * BLOCK_CELLS], block, BLOCK_BYTES);
+	sprintf(temporary, "%s.new", store.path);
+
+	status = block_store_save(temporary, blocks, nb_blocks,
+			store.header->version >= 2);
+
+	if (status == 0 && rename(temporary, store.path) == -1)
+	{
+		perror(store.path);
+		unlink(temporary);
+		status = -1;
+	}
+
+	free(temporary);
+	free(blocks);
+
+	return status;
+}
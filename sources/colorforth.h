@@ -7,19 +7,130 @@
 
 #pragma once
 
+#include <stdio.h>
 #include <inttypes.h>
+#include <stdbool.h>
 
 #define FORTH_DICTIONARY 1
 #define MACRO_DICTIONARY 0
 
+#define BLOCK_CELLS 256		// 1 KiB blocks
+
 typedef int32_t cell_t;
 
+// What the interpreter thread publishes after each word
+struct worker_snapshot
+{
+	char *stack;			// As printed by dot_s()
+	bool  is_word_missing;		// A word typed at the prompt was not found
+	bool  are_blocks_changed;	// The block file was reloaded
+};
+
+// A cell naming a word in the blocks
+struct xref_location
+{
+	cell_t   block;
+	uint16_t cell;
+	uint8_t  tag;		// Its color, what is done with the word
+};
+
+// Shared by the SDL and terminal front ends
+#define WORD_MAX_LENGTH   20
+#define CANDIDATES_LENGTH 64
+
+struct rgb
+{
+	uint8_t r, g, b;
+};
+
+enum front_end_key
+{
+	KEY_F1, KEY_F2, KEY_F3, KEY_F4, KEY_F5, KEY_F6,	// F1 to F8 pick the color
+	KEY_F7, KEY_F8, KEY_F9, KEY_F10, KEY_F11, KEY_F12,
+	KEY_PAGE_UP, KEY_PAGE_DOWN, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN,
+	KEY_HOME, KEY_END, KEY_DELETE, KEY_BACKSPACE, KEY_SPACE, KEY_ESCAPE,
+	KEY_RETURN, KEY_TAB
+};
+
+struct front_end
+{
+	char        word[WORD_MAX_LENGTH];	// Typed at the prompt
+	struct rgb  color;			// Of the typed word
+	cell_t      color_tag;			// Of the words inserted
+	bool        is_command;			// F9, F10 edits the block
+	cell_t      block;			// Displayed
+	const char *message;			// Error shown under the stack
+	char        candidates[CANDIDATES_LENGTH];	// Names starting with the word
+	char       *stack;			// As last published
+	bool        is_overlay_shown;		// F11
+	bool        is_redraw_needed;
+};
+
+enum compile_mode
+{
+	THREADED_CODE,			// Cells of function pointers
+	SUBROUTINE_THREADED_CODE	// Native calls, x86-64 only
+};
 
+int get_code_index(const char letter);
 cell_t pack(const char *word_name);
+int pack_word(const char *text, cell_t *cells, const int max_cells);
 char *unpack(cell_t word);
 void run_block(const cell_t nb_block);
+void set_fuel(const long budget);
+bool is_run_suspended(void);
+void resume_run(void);
+void drop_run(void);
 char *dot_s(void);
 void do_word(cell_t word);
 struct word_entry *lookup_word(cell_t name, const bool force_dictionary);
+int set_compile_mode(const enum compile_mode mode);
+void decompile(const struct word_entry *word, FILE *out);
+int profiler_start(const unsigned int frequency);
+void profiler_stop(FILE *report, FILE *folded);
+int block_store_open(const char *path);
+void block_store_close(void);
+cell_t block_count(void);
+const cell_t *block_cells(const cell_t n, unsigned int *nb_cells);
+int block_verify(const cell_t n);
+int block_extent(const cell_t n, uint64_t *offset, uint32_t *size);
+const char *block_store_path(void);
+uint64_t block_store_hash(void);
+int block_store_save(const char *path, const cell_t *cells, const cell_t nb_blocks,
+		const bool compress);
+int block_store_write(const cell_t n, const cell_t *cells, const unsigned int nb_cells);
+int block_store_watch(void);
+int block_store_poll(void (*changed)(const cell_t n));
+void block_store_unwatch(void);
+void block_prefetch(const cell_t first, const cell_t last, const cell_t step);
+void block_prefetch_enable(const bool is_enabled);
+uint32_t crc32c(const void *data, const size_t length);
+void xref_update(const cell_t n);
+void xref_clear(void);
+struct xref_location *xref_find(const cell_t word, unsigned int *nb_locations);
+void name_add(const cell_t word);
+void names_clear(void);
+unsigned int names_complete(const char *text, char (*matches)[WORD_MAX_LENGTH],
+		const unsigned int max, char *common);
+void reload_block(const cell_t n);
+void colorforth_interrupt(void);
+unsigned long task_switch_count(void);
+int worker_start(void (*callback)(void));
+void worker_stop(void);
+int worker_submit(const cell_t word);
+bool worker_is_busy(void);
+struct worker_snapshot *worker_snapshot(void);
+void worker_snapshot_free(struct worker_snapshot *snapshot);
+void worker_lock_blocks(void);
+void worker_unlock_blocks(void);
+extern const struct rgb palette[16];
+extern struct front_end front_end;
+void word_text(const cell_t word, char *text, const size_t size);
+unsigned int displayed_cells(cell_t *cells, int *cursor);
+void front_end_key(const enum front_end_key key);
+void front_end_text(const char *text);
+void front_end_snapshot(void);
+int front_end_start(const char *path, void (*published)(void));
+void front_end_stop(void);
 void colorforth_initialize(void);
 void colorforth_finalize(void);
@@ -5,26 +5,48 @@
  * found in the LICENSE file.
  */
 
+#define _GNU_SOURCE	// memfd_create()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <sys/queue.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/time.h>
+
+#ifdef PROFILE_WORDS
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#endif
 
 #include "colorforth.h"
 
 #define CODE_HEAP_SIZE (1024 * 100)	// 100 Kb
-#define STACK_SIZE     42
+#define NATIVE_HEAP_SIZE (1024 * 1024)	// 1 Mb
+
+// Depth of the data and return stacks in cells, override with -DSTACK_SIZE=n
+#ifndef STACK_SIZE
+#define STACK_SIZE     (1024 * 64)
+#endif
 
 #define FORTH_TRUE -1      // In Forth world -1 means true
 #define FORTH_FALSE 0
 
+// Longest bodies copied at call sites instead of called
+#define INLINE_MAX_CELLS 8
+#define INLINE_MAX_BYTES 100	// Native code, 3 literals or calls
+
 /*
  * Data types
  */
@@ -36,6 +58,14 @@ struct word_entry
 	void                  *code_address;
 	void                  *codeword;
 	LIST_ENTRY(word_entry) next;
+	unsigned char          inline_body[INLINE_MAX_BYTES];	// Copy of a short body
+	unsigned short         inline_size;		// In bytes, 0 when called
+	bool                   is_inline_tail_call;	// Body ends with a native call
+	bool                   is_inline_disabled;	// By noinl
+#ifdef PROFILE_WORDS
+	unsigned long          calls;
+	uint64_t               cycles;	// Including the words it calls
+#endif
 };
 
 typedef void (*FUNCTION_EXEC)(void);
@@ -50,13 +80,94 @@ typedef void (*FUNCTION_EXEC)(void);
 #define rpop()        *(rtos--)
 #define start_of(x)   (&x[0])
 
+/*
+ * Both stacks live in their own mapping surrounded by inaccessible guard
+ * pages, so running off either end faults instead of corrupting memory
+ * and the primitives don't have to check bounds. As before, cell 0 is
+ * never pushed to: it is the last cell of the low guard page, so even
+ * the first pop of an empty stack faults.
+ */
+struct guarded_stack
+{
+	void   *mapping;
+	size_t  length;
+	char   *low_guard_end;	// Cell 1 starts here...
+	char   *high_guard;	// ...and end here.
+};
+
+static struct guarded_stack data_stack_area, return_stack_area;
+
+#define stack_base(area) ((void *)((area)->low_guard_end - sizeof(long)))
+
+/*
+ * Tasks
+ *
+ * Each task runs a threaded word with its own stacks and IP. Only the
+ * running task has them in the globals below, pause saves them in its
+ * task and loads the next one's: NEXT carries on with another IP, the C
+ * stack is left alone. Task 0 is the host, the outer interpreter gives
+ * the others a turn after each word. Tasks are linked in a ring.
+ */
+#define MAX_TASKS 16
+
+struct task
+{
+	struct guarded_stack data_area;
+	struct guarded_stack return_area;
+	long                *stack;
+	long                *tos;
+	unsigned long       *rstack;
+	unsigned long       *rtos;
+	unsigned long       *IP;
+	unsigned long        boot[3];	// Calls the word then ends the task
+	int                  next;	// In the ring
+	bool                 is_used;
+};
+
+static struct task   tasks[MAX_TASKS];
+static int           current_task;
+static int           next_depth;		// NEXT loops running on the C stack
+static int           task_depth;		// The one the running task switches in
+static unsigned long task_switches;
+static bool          is_host_waiting;	// Until the other tasks end
+
 /* Data stack */
-long stack[STACK_SIZE];
-long *tos = start_of(stack);	// Top Of Stack
+long *stack;
+long *tos;			// Top Of Stack
 
 /* Return stack */
-unsigned long rstack[STACK_SIZE];
-unsigned long *rtos = start_of(rstack);
+unsigned long *rstack;
+unsigned long *rtos;
+
+static sigjmp_buf   stack_fault_recovery;
+static volatile int is_recovery_armed;
+static volatile int last_stack_fault;
+static volatile int is_interrupt_requested;	// Set from another thread
+
+/*
+ * Fuel
+ *
+ * With a budget set, each call and backward branch burns one unit. Out
+ * of fuel, a task is preempted and the definition run by the outer
+ * interpreter is suspended, to be resumed later with a new budget.
+ * Anything else is stopped like an interrupt: code run by a nested
+ * block, native code.
+ */
+static long fuel = LONG_MAX;
+static long fuel_budget;		// Per run, 0 for no limit
+static bool is_resumable;		// Outermost definition of the host
+
+static int          block_depth;	// Blocks interpreted inside each other
+static cell_t       outer_block;
+static unsigned int outer_position;	// Of the word running in outer_block
+
+static struct
+{
+	bool           is_suspended;
+	cell_t         block;		// -1 for a word run alone
+	unsigned int   position;
+	unsigned long *IP;		// Of the cell that ran out
+} suspended;
 
 /*
  * Global variables
@@ -64,12 +175,40 @@ unsigned long *rtos = start_of(rstack);
 unsigned long *code_here;
 unsigned long *h;			// Code is inserted here
 bool          selected_dictionary;
-cell_t        *blocks;			// Manage looping over the code contained in blocks
 unsigned long *IP;			// Instruction Pointer
+const struct word_entry *W;		// Word being executed
+unsigned long *last_call;		// Last compiled call, for tail calls
+void (*next_word_consumer)(const cell_t);	// Set by words parsing the next one
+enum compile_mode compile_mode = THREADED_CODE;
 
 LIST_HEAD(, word_entry) forth_dictionary;
 LIST_HEAD(, word_entry) macro_dictionary;
 
+/*
+ * Resolution cache
+ *
+ * Each block cell remembers the entry its word resolved to, so loading
+ * the same blocks again skips the dictionary search. Names hash into
+ * buckets with a generation counter: defining a word bumps the counter
+ * of its bucket, which only invalidates resolutions of names sharing it.
+ * Words typed at the prompt use a table indexed by the same hash.
+ */
+#define RESOLUTION_BUCKETS 4096
+
+struct resolution
+{
+	cell_t             word;	// Packed name with its color
+	unsigned int       generation;
+	struct word_entry *entry;	// NULL when not found
+	bool               dictionary;	// Where entry was found
+};
+
+static unsigned int      name_generation[RESOLUTION_BUCKETS];
+static struct resolution prompt_resolutions[RESOLUTION_BUCKETS];
+static struct resolution **block_resolutions;
+static cell_t            nb_block_resolutions;
+static struct resolution *current_resolution; // Cell being interpreted
+
 /*
  * Prototypes
  */
@@ -84,6 +223,16 @@ static void compile_macro(const cell_t word);
 static void interpret_number(const cell_t number);
 static void variable_word(const cell_t word);
 static void literal(void);
+static void see(void);
+static void inline_record(void);
+static void interrupt(void);
+static bool out_of_fuel(const bool is_in_next);
+static void resume_suspended(const cell_t n);
+static void *guarded_stack_allocate(struct guarded_stack *area);
+static void pause_word(void);
+static void task_word(void);
+static void where(void);
+static void uses(void);
 
 
 /* Word extensions (0), comments (9, 10, 11, 15), compiler feedback (13)
@@ -134,11 +283,84 @@ pack(const char *word_name)
 	return packed;
 }
 
+static int
+char_length(const int index)
+{
+	return 4 + (index > 7) + (2 * (index > 15));
+}
+
+static int
+char_code(const int index)
+{
+	int length = char_length(index);
+
+	return index + (8 * (length == 5)) + ((96 - 16) * (length == 7));
+}
+
+/*
+ * Pack a word of any length, long words continue in extension cells
+ * (tag 0). When the next character doesn't fit, it is still packed if
+ * the bits that don't fit are zeros, just like the colorForth editor
+ * does. Returns the number of cells without tag, -1 if a character can't
+ * be packed or the cells don't fit.
+ */
+int
+pack_word(const char *text, cell_t *cells, const int max_cells)
+{
+	char chunk[8];	// At most 7 characters of 4 bits fit in a cell
+	size_t length = strlen(text);
+	size_t i = 0;
+	int nb_cells = 0;
+
+	for (size_t j = 0; j < length; j++)
+		if (!strchr(code, text[j]))
+			return -1;
+
+	while (i < length)
+	{
+		int bits = 28;
+		size_t n = 0;
+		cell_t cell;
+
+		while (i + n < length
+				&& char_length(get_code_index(text[i + n])) <= bits)
+			bits -= char_length(get_code_index(text[i + n++]));
+
+		memcpy(chunk, &text[i], n);
+		chunk[n] = '\0';
+		cell = n ? pack(chunk) : 0;
+		i += n;
+
+		if (i < length && bits > 0)
+		{
+			int index = get_code_index(text[i]);
+			int drop  = char_length(index) - bits;
+			int mask  = (1 << drop) - 1;
+
+			if (!(char_code(index) & mask))
+			{
+				cell |= (char_code(index) >> drop) << 4;
+				i++;
+			}
+		}
+
+		if (!cell)
+			continue;
+
+		if (nb_cells == max_cells)
+			return -1;
+
+		cells[nb_cells++] = cell;
+	}
+
+	return nb_cells;
+}
+
 char *
 unpack(const cell_t word)
 {
 	unsigned char nibble;
-	static char text[16];
+	static __thread char text[16];	// The editor and the interpreter both unpack
 	unsigned int coded, bits, i;
 
 	coded  = word;
@@ -177,11 +399,218 @@ unpack(const cell_t word)
 	return text;
 }
 
+/*
+ * Inner interpreter: run cells until the outermost definition returns.
+ * IP always points to the cell following the one being executed.
+ */
 void
 NEXT(void)
 {
-	IP++;
-	((FUNCTION_EXEC)*IP)();
+	while (IP)
+	{
+		if (is_interrupt_requested)
+			interrupt();
+
+		((FUNCTION_EXEC)*IP++)();
+	}
+}
+
+/*
+ * Subroutine-threaded code (x86-64)
+ *
+ * Definitions become plain C-callable functions made of native calls to
+ * the primitives, so the CPU's return address predictor does the
+ * dispatch. Each definition keeps the stack 16-byte aligned for the C
+ * primitives it calls by reserving 8 bytes on entry.
+ *
+ * The heap is mapped when native code is selected, twice: code runs
+ * from a read and execute view and is written through a read and write
+ * one, so no page is ever both writable and executable. Macros compiled
+ * natively write code while native code runs, flipping the protection
+ * of the pages would pull them from under it.
+ */
+static unsigned char *native_heap;	// Executed
+static unsigned char *native_alias;	// Written, the same pages
+static unsigned char *native_here;
+static unsigned char *last_native_call;
+static unsigned long  native_stack_limit;	// Lowest rsp of a run, 0 out of one
+
+#define NATIVE_CALL_SIZE         12	// mov rax, imm64; call rax
+#define NATIVE_CHECK_SIZE        27	// mov rax, imm64; test; jcc; call
+#define NATIVE_FALL_THROUGH_SIZE 4	// add rsp, 8
+
+static void
+emit(const unsigned char *bytes, const size_t length)
+{
+	if (native_here + length > native_heap + NATIVE_HEAP_SIZE)
+	{
+		fprintf(stderr, "Error: Native code heap is full!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(native_alias + (native_here - native_heap), bytes, length);
+	native_here += length;
+}
+
+static void
+emit_imm64(const unsigned char opcode[2], const unsigned long value)
+{
+	emit(opcode, 2);
+	emit((const unsigned char *)&value, sizeof(value));
+}
+
+#define NATIVE_PROLOGUE_SIZE (4 + 2 * NATIVE_CHECK_SIZE)
+
+static void native_out_of_fuel(void);
+static void native_stack_overflow(void);
+
+// Calls failure() unless test on the variable jumps over it
+static void
+native_check(const void *variable, const unsigned char test[5],
+		void (*failure)(void))
+{
+	emit_imm64((const unsigned char []){0x48, 0xb8}, (unsigned long)variable);
+	emit(test, 5);
+	emit_imm64((const unsigned char []){0x48, 0xb8}, (unsigned long)failure);
+	emit((const unsigned char []){0xff, 0xd0}, 2); // call rax
+}
+
+// Calls and tail calls all enter here: the depth is bounded like the
+// return stack and recursion burns fuel like NEXT
+static void
+native_prologue(void)
+{
+	emit((const unsigned char []){0x48, 0x83, 0xec, 0x08}, 4); // sub rsp, 8
+	native_check(&native_stack_limit, (const unsigned char []){
+		0x48, 0x3b, 0x20,	// cmp rsp, [rax]
+		0x73, 0x0c		// jae over the call
+	}, native_stack_overflow);
+	native_check(&fuel, (const unsigned char []){
+		0x48, 0xff, 0x08,	// dec qword [rax]
+		0x75, 0x0c		// jnz over the call
+	}, native_out_of_fuel);
+}
+
+static void
+native_exit(void)
+{
+	emit((const unsigned char []){
+		0x48, 0x83, 0xc4, 0x08,	// add rsp, 8
+		0xc3			// ret
+	}, 5);
+}
+
+static void
+native_call(void *function)
+{
+	last_native_call = native_here;
+
+	emit_imm64((const unsigned char []){0x48, 0xb8}, (unsigned long)function);
+	emit((const unsigned char []){0xff, 0xd0}, 2); // call rax
+}
+
+static bool
+native_tail_call(void)
+{
+	if (!last_native_call || last_native_call + NATIVE_CALL_SIZE != native_here)
+		return false;
+
+	// Keep the mov, replace the call
+	native_here -= 2;
+	emit((const unsigned char []){
+		0x48, 0x83, 0xc4, 0x08,	// add rsp, 8
+		0xff, 0xe0		// jmp rax
+	}, 6);
+
+	last_native_call = NULL;
+	return true;
+}
+
+static void
+native_literal(const long n)
+{
+	emit_imm64((const unsigned char []){0x48, 0xba}, (unsigned long)&tos);
+	emit((const unsigned char []){
+		0x48, 0x8b, 0x02,	// mov rax, [rdx]
+		0x48, 0x83, 0xc0, 0x08,	// add rax, 8
+		0x48, 0x89, 0x02	// mov [rdx], rax
+	}, 10);
+	emit_imm64((const unsigned char []){0x48, 0xb9}, n);
+	emit((const unsigned char []){0x48, 0x89, 0x08}, 3); // mov [rax], rcx
+}
+
+/*
+ * Calls test() and jumps when it returns non zero. Returns the location
+ * of the 32-bit displacement for native_resolve().
+ */
+static unsigned char *
+native_branch_if(long (*test)(void))
+{
+	native_call((void *)test);
+	emit((const unsigned char []){
+		0x48, 0x85, 0xc0,	// test rax, rax
+		0x0f, 0x85		// jnz rel32
+	}, 5);
+	emit((const unsigned char []){0, 0, 0, 0}, 4);
+
+	return native_here - 4;
+}
+
+static void
+native_resolve(unsigned char *displacement, const unsigned char *target)
+{
+	int32_t offset = target - (displacement + 4);
+	memcpy(native_alias + (displacement - native_heap), &offset, 4);
+}
+
+static int
+native_heap_map(void)
+{
+	int fd = memfd_create("native code", 0);
+	void *code, *alias;
+
+	if (fd == -1)
+		return -1;
+
+	if (ftruncate(fd, NATIVE_HEAP_SIZE) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	code  = mmap(NULL, NATIVE_HEAP_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	alias = mmap(NULL, NATIVE_HEAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (code == MAP_FAILED || alias == MAP_FAILED)
+	{
+		if (code != MAP_FAILED)
+			munmap(code, NATIVE_HEAP_SIZE);
+		if (alias != MAP_FAILED)
+			munmap(alias, NATIVE_HEAP_SIZE);
+		return -1;
+	}
+
+	native_heap  = code;
+	native_alias = alias;
+	native_here  = native_heap;
+	return 0;
+}
+
+int
+set_compile_mode(const enum compile_mode mode)
+{
+#if defined(__x86_64__)
+	// Without an executable heap, only threaded code is available
+	if (mode == SUBROUTINE_THREADED_CODE && !native_heap
+			&& native_heap_map() == -1)
+		return -1;
+
+	compile_mode = mode;
+	return 0;
+#else
+	return mode == THREADED_CODE ? 0 : -1;
+#endif
 }
 
 /*
@@ -191,7 +620,7 @@ void comma(void)
 {
 	*h = stack_pop();
 	printf("\t, Comma: h at: %p, pointing to %p, TOS = %x\n", h, (void *)*h,
-			(unsigned int)*(tos));
+			tos > start_of(stack) ? (unsigned int)*tos : 0);
 	h++;
 }
 
@@ -206,6 +635,9 @@ void loads(void)
 	int j = stack_pop();
 	int i = stack_pop();
 
+	// Read them all ahead, in the background while the first ones run
+	block_prefetch(i, j, 2);
+
 	// Load blocks, excluding shadow blocks
 	for (; i <= j; i += 2)
 	{
@@ -224,11 +656,183 @@ void macro(void)
 	selected_dictionary = MACRO_DICTIONARY;
 }
 
+#ifdef PROFILE_WORDS
+/*
+ * Per-word counters
+ *
+ * In this build every call is compiled through the counting helpers
+ * below, and each threaded definition entered gets a frame recording
+ * when it started, closed by the matching exit_definition().
+ */
+struct call_frame
+{
+	struct word_entry *word;	// NULL for uncounted entries
+	uint64_t           start;
+};
+
+static struct call_frame call_frames[STACK_SIZE];
+static size_t            nb_call_frames;
+
+static inline uint64_t
+read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static void
+open_call_frame(struct word_entry *word)
+{
+	call_frames[nb_call_frames].word  = word;
+	call_frames[nb_call_frames].start = read_cycles();
+	nb_call_frames++;
+}
+
+static void
+close_call_frame(void)
+{
+	struct call_frame *frame = &call_frames[--nb_call_frames];
+
+	if (frame->word)
+	{
+		frame->word->calls++;
+		frame->word->cycles += read_cycles() - frame->start;
+	}
+}
+
+void counted_call_aux(void)
+{
+	struct word_entry *word;
+
+	if (--fuel == 0 && out_of_fuel(true))
+		return;
+
+	word = (struct word_entry *)*IP++;
+	open_call_frame(word);
+	rpush((unsigned long)IP);
+	IP = word->code_address;
+}
+
+void counted_primitive(void)
+{
+	struct word_entry *word = (struct word_entry *)*IP++;
+	uint64_t start = read_cycles();
+
+	((FUNCTION_EXEC)word->code_address)();
+
+	word->calls++;
+	word->cycles += read_cycles() - start;
+}
+
+static int
+compare_cycles(const void *a, const void *b)
+{
+	const struct word_entry *x = *(struct word_entry * const *)a;
+	const struct word_entry *y = *(struct word_entry * const *)b;
+
+	if (x->cycles == y->cycles)
+		return 0;
+
+	return x->cycles < y->cycles ? 1 : -1;
+}
+
+static void
+word_counters_report(FILE *out)
+{
+	struct word_entry *item, **called;
+	size_t nb_called = 0, size = 0;
+
+	LIST_FOREACH(item, &forth_dictionary, next)
+		size++;
+	LIST_FOREACH(item, &macro_dictionary, next)
+		size++;
+
+	if (!(called = calloc(size + 1, sizeof(*called))))
+		return;
+
+	LIST_FOREACH(item, &forth_dictionary, next)
+		if (item->calls)
+			called[nb_called++] = item;
+	LIST_FOREACH(item, &macro_dictionary, next)
+		if (item->calls)
+			called[nb_called++] = item;
+
+	qsort(called, nb_called, sizeof(*called), compare_cycles);
+
+	fprintf(out, "%12s %16s %12s  %s\n", "calls", "cycles", "cycles/call", "word");
+
+	for (size_t i = 0; i < nb_called; i++)
+		fprintf(out, "%12lu %16" PRIu64 " %12" PRIu64 "  %s\n",
+				called[i]->calls, called[i]->cycles,
+				called[i]->cycles / called[i]->calls,
+				unpack(called[i]->name));
+
+	free(called);
+}
+
+void dot_prof(void)
+{
+	word_counters_report(stdout);
+}
+#endif
+
 void exit_definition(void)
 {
-	long n = rpop();
-	printf(" => Exit\n");
-	(void)n;
+#ifdef PROFILE_WORDS
+	close_call_frame();
+#endif
+	IP = (unsigned long *)rpop();
+}
+
+void call_aux(void)
+{
+	unsigned long *target;
+
+	if (--fuel == 0 && out_of_fuel(true))
+		return;
+
+	target = (unsigned long *)*IP++;
+	rpush((unsigned long)IP);
+	IP = target;
+}
+
+void jump_aux(void)
+{
+	if (--fuel == 0 && out_of_fuel(true))
+		return;
+
+	IP = (unsigned long *)*IP;
+}
+
+void semicolon(void)
+{
+	inline_record();
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		if (!native_tail_call())
+			native_exit();
+		return;
+	}
+
+#ifndef PROFILE_WORDS
+	// A call right before ';' becomes a jump, the callee returns for us
+	if (last_call && last_call + 2 == h)
+	{
+		*last_call = (unsigned long)jump_aux;
+		last_call  = NULL;
+		return;
+	}
+#endif
+
+	stack_push((long)exit_definition);
+	comma();
 }
 
 void add(void)
@@ -320,13 +924,8 @@ void or(void)
 
 void dup_word(void)
 {
-	extern bool is_command;
-	extern bool is_dirty_hack;
 	long n = *tos;
 	stack_push(n);
-
-	if (is_command && !is_dirty_hack)
-		NEXT();
 }
 
 void drop(void)
@@ -362,8 +961,8 @@ char *dot_s(void)
 
 	memset(buffer, 0, 60);
 
-	for (int i = 1; i < nb_items + 1; i++)
-		pos += snprintf(&buffer[pos], 60, "%d ", (int)stack[i]);
+	for (int i = 1; i < nb_items + 1 && pos < 60; i++)
+		pos += snprintf(&buffer[pos], 60 - pos, "%d ", (int)stack[i]);
 
 	return strdup(buffer);
 }
@@ -397,85 +996,308 @@ void zero_branch(void)
 		IP++;
 	else
 		IP = (unsigned long *)*IP;
-
-	NEXT();
 }
 
-void if_(void)
+long zero_branch_test(void)
 {
-	stack_push((long)zero_branch);
-	comma();
+	long n = stack_pop();
 
-	here();
-	stack_push(0);
-	comma();
+	return n != FORTH_TRUE;
 }
 
-void then(void)
+// -if runs its code for a negative number
+void minus_branch(void)
 {
-	here();
-	swap();
-	store();
+	long n = stack_pop();
+
+	if (n < 0)
+		IP++;
+	else
+		IP = (unsigned long *)*IP;
 }
 
-void for_aux(void)
+long minus_branch_test(void)
 {
 	long n = stack_pop();
-	rpush(n);
-	printf("FOR_AUX\n");
 
-	NEXT();
+	return n >= 0;
 }
 
-void next_aux(void)
-{
-	long n = rpop();
-	long addr = rpop();
+/*
+ * Fused compare and branch
+ *
+ * A comparison compiled right before if becomes a single branch taking
+ * both numbers, taken when the comparison is false: the flag is never
+ * pushed. Threaded branches have their target in the next cell, native
+ * tests return non zero to branch.
+ */
+#define COMPARE_BRANCH(name, operator)				\
+void name##_branch(void)					\
+{								\
+	long n = stack_pop();					\
+	long m = stack_pop();					\
+								\
+	if (m operator n)					\
+		IP++;						\
+	else							\
+		IP = (unsigned long *)*IP;			\
+}								\
+								\
+long name##_branch_test(void)					\
+{								\
+	long n = stack_pop();					\
+	long m = stack_pop();					\
+								\
+	return !(m operator n);					\
+}
+
+COMPARE_BRANCH(lt, <)
+COMPARE_BRANCH(gt, >)
+COMPARE_BRANCH(le, <=)
+COMPARE_BRANCH(ge, >=)
+COMPARE_BRANCH(eq, ==)
+COMPARE_BRANCH(ne, !=)
+
+static const struct
+{
+	FUNCTION_EXEC compare;
+	FUNCTION_EXEC branch;
+	long        (*test)(void);
+} fused_branches[] = {
+	{ lt, lt_branch, lt_branch_test },
+	{ gt, gt_branch, gt_branch_test },
+	{ le, le_branch, le_branch_test },
+	{ ge, ge_branch, ge_branch_test },
+	{ eq, eq_branch, eq_branch_test },
+	{ ne, ne_branch, ne_branch_test },
+};
 
-	rpush(addr);
+#define NB_FUSED_BRANCHES (sizeof(fused_branches) / sizeof(fused_branches[0]))
 
-	n--;
-	rpush(n);
+static void *last_compare;		// Where the last comparison was compiled
+static size_t last_compare_index;
 
-	if (n > 0)
-	{
-		IP = (unsigned long *)addr;
-		printf("***NEXT_AUX: %lx\n", addr);
-		((FUNCTION_EXEC)*IP)();
-	}
+static size_t
+fused_branch_index(const void *code)
+{
+	size_t i;
 
-	(void)rpop();
-	(void)rpop();
-}
+	for (i = 0; i < NB_FUSED_BRANCHES; i++)
+		if (fused_branches[i].compare == code)
+			break;
 
-void for_(void)
-{
-	stack_push((long)for_aux);
-	comma();
-printf("***FOR_ = %p\n", h);
-	rpush((long)h);
+	return i;
 }
 
-void next_(void)
+// Remembers a comparison about to be compiled, if may take it back
+static void
+compile_compare(const void *code)
 {
-	printf("***NEXT_\n");
-	stack_push((long)next_aux);
-	comma();
+	last_compare_index = fused_branch_index(code);
+	last_compare = last_compare_index == NB_FUSED_BRANCHES ? NULL
+		: compile_mode == SUBROUTINE_THREADED_CODE ? (void *)native_here
+		: (void *)h;
 }
 
-void rdrop(void)
+// Takes back the comparison compiled last, if nothing followed it
+static bool
+uncompile_compare(void)
 {
-	(void)rpop();
-}
+	void *compare = last_compare;
 
-void dot(void)
-{
-	printf("%d ", (int)stack_pop());
-}
+	last_compare = NULL;
+
+	if (compare && compile_mode == SUBROUTINE_THREADED_CODE
+			&& native_here == (unsigned char *)compare + NATIVE_CALL_SIZE)
+	{
+		native_here      = compare;
+		last_native_call = NULL;
+		return true;
+	}
+
+	if (compare && compile_mode == THREADED_CODE
+			&& h == (unsigned long *)compare + 1)
+	{
+		h = compare;
+		return true;
+	}
+
+	return false;
+}
+
+static void
+compile_branch(FUNCTION_EXEC branch, long (*test)(void))
+{
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		stack_push((long)native_branch_if(test));
+		return;
+	}
+
+	stack_push((long)branch);
+	comma();
+
+	here();
+	stack_push(0);
+	comma();
+}
+
+void if_(void)
+{
+	if (uncompile_compare())
+		compile_branch(fused_branches[last_compare_index].branch,
+				fused_branches[last_compare_index].test);
+	else
+		compile_branch(zero_branch, zero_branch_test);
+}
+
+void then(void)
+{
+	// Code jumps here, what was compiled before can't be fused with an if
+	last_compare = NULL;
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		native_resolve((unsigned char *)stack_pop(), native_here);
+		last_native_call = NULL;
+		return;
+	}
+
+	here();
+	swap();
+	store();
+
+	// Code jumps here, it can't be the tail of a call anymore
+	last_call = NULL;
+}
+
+void minus_if(void)
+{
+	last_compare = NULL;
+	compile_branch(minus_branch, minus_branch_test);
+}
+
+void else_(void)
+{
+	long condition = stack_pop();	// Left by if
+
+	last_compare = NULL;
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		emit((const unsigned char []){0xe9, 0, 0, 0, 0}, 5); // jmp rel32
+		stack_push((long)(native_here - 4));
+	}
+	else
+	{
+		stack_push((long)jump_aux);
+		comma();
+
+		here();
+		stack_push(0);
+		comma();
+	}
+
+	// The false branch starts here
+	stack_push(condition);
+	then();
+}
+
+void for_aux(void)
+{
+	long n = stack_pop();
+	rpush(n);
+}
+
+void next_aux(void)
+{
+	if (--fuel == 0 && out_of_fuel(true))
+		return;
+
+	// The loop counter is on top of the return stack
+	if (--*rtos)
+	{
+		IP = (unsigned long *)*IP;
+	}
+	else
+	{
+		(void)rpop();
+		IP++;
+	}
+}
+
+static void
+native_out_of_fuel(void)
+{
+	if (is_interrupt_requested)
+		interrupt();
+
+	(void)out_of_fuel(false);
+}
+
+long next_test(void)
+{
+	// Native loops don't go through NEXT
+	if (is_interrupt_requested)
+		interrupt();
+
+	if (--fuel == 0)
+		(void)out_of_fuel(false);
+
+	if (--*rtos)
+		return 1;
+
+	(void)rpop();
+	return 0;
+}
+
+void for_(void)
+{
+	last_compare = NULL;
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		native_call(for_aux);
+		stack_push((long)native_here);
+		return;
+	}
+
+	stack_push((long)for_aux);
+	comma();
+
+	// Loop start, resolved by next
+	here();
+}
+
+void next_(void)
+{
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		unsigned char *loop = (unsigned char *)stack_pop();
+		native_resolve(native_branch_if(next_test), loop);
+		return;
+	}
+
+	stack_push((long)next_aux);
+	comma();
+
+	// Loop start left by for
+	comma();
+}
+
+void rdrop(void)
+{
+	(void)rpop();
+}
+
+void dot(void)
+{
+	printf("%d ", (int)stack_pop());
+}
 
 void i_word(void)
 {
-	long n = rpop();
+	long n = *rtos;
 	stack_push(n);
 }
 
@@ -498,442 +1320,2301 @@ dump_dict(void)
 	}
 }
 
-void
-do_word(const cell_t word)
+static unsigned int
+name_bucket(const cell_t word)
 {
-	uint8_t color = (int)word & 0x0000000f;
-
-	if (color == 2 || color == 5 || color == 6 || color == 8 || color == 15)
-	{
-		printf("Color = %1d, Word = %10d, packed = %8x\n",
-				color, word >> 5, word);
-	}
-	else if (color != 0)
-	{
-		printf("Color = %1d, Word = %10s, packed = %8x\n",
-				color, unpack(word), word);
-	}
+	uint32_t name = word & 0xfffffff0;
 
-	(*color_word_action[color])(word);
+	return (name * 2654435761u) >> 20; // 12 bits
 }
 
-void
-run_block(const cell_t n)
+static struct resolution *
+resolution_slot(const cell_t word)
 {
-	unsigned long start = n * 256;     // Start executing block from here...
-	unsigned long limit = (n+1) * 256; // ...to this point.
+	if (current_resolution)
+		return current_resolution;
 
-	for (unsigned long i = start; i < limit-1; i++)
-		do_word(blocks[i]);
+	return &prompt_resolutions[name_bucket(word)];
 }
 
-struct word_entry *
-lookup_word(cell_t name, const bool force_dictionary)
+static bool
+is_resolved(const struct resolution *slot, const cell_t word)
 {
-	struct word_entry *item;
+	return slot->word == word
+		&& slot->generation == name_generation[name_bucket(word)];
+}
 
-	name &= 0xfffffff0; // Don't care about the color byte
-	printf("Lookup : %x\n", name);
+static struct word_entry *
+remember_resolution(struct resolution *slot, const cell_t word,
+		struct word_entry *entry, const bool dictionary)
+{
+	slot->word       = word;
+	slot->generation = name_generation[name_bucket(word)];
+	slot->entry      = entry;
+	slot->dictionary = dictionary;
 
-	if (force_dictionary == FORTH_DICTIONARY)
+	return entry;
+}
+
+static struct resolution *
+block_resolution_slots(const cell_t n)
+{
+	if (n >= nb_block_resolutions)
 	{
-		LIST_FOREACH(item, &forth_dictionary, next)
+		struct resolution **grown = realloc(block_resolutions,
+				(n + 1) * sizeof(*grown));
+
+		if (!grown)
 		{
-			if (name == item->name)
-				return item;
+			fprintf(stderr, "Error: Not enough memory!\n");
+			colorforth_finalize();
+			exit(EXIT_FAILURE);
 		}
+
+		memset(&grown[nb_block_resolutions], 0,
+			(n + 1 - nb_block_resolutions) * sizeof(*grown));
+
+		block_resolutions    = grown;
+		nb_block_resolutions = n + 1;
 	}
-	else
+
+	if (!block_resolutions[n])
 	{
-		LIST_FOREACH(item, &macro_dictionary, next)
+		block_resolutions[n] = calloc(BLOCK_CELLS, sizeof(struct resolution));
+
+		if (!block_resolutions[n])
 		{
-			if (name == item->name)
-				return item;
+			fprintf(stderr, "Error: Not enough memory!\n");
+			colorforth_finalize();
+			exit(EXIT_FAILURE);
 		}
 	}
 
-	return NULL;
+	return block_resolutions[n];
 }
 
 static void
-insert_builtins_into_forth_dictionary(void)
+stack_reset(void)
 {
-	struct word_entry *_comma, *_load, *_loads, *_forth, *_macro,
-		*_exit, *_store, *_fetch, *_add, *_one_complement, *_mult,
-		*_div, *_ne, *_dup, *_drop, *_nip, *_negate, *_dot, *_here, *_i,
-		*_over;
+	tos  = start_of(stack);
+	rtos = start_of(rstack);
+	IP   = NULL;
 
-	_comma		= calloc(1, sizeof(struct word_entry));
-	_load		= calloc(1, sizeof(struct word_entry));
-	_loads		= calloc(1, sizeof(struct word_entry));
-	_forth		= calloc(1, sizeof(struct word_entry));
-	_macro		= calloc(1, sizeof(struct word_entry));
-	_exit		= calloc(1, sizeof(struct word_entry));
-	_store		= calloc(1, sizeof(struct word_entry));
-	_fetch		= calloc(1, sizeof(struct word_entry));
-	_add		= calloc(1, sizeof(struct word_entry));
-	_one_complement	= calloc(1, sizeof(struct word_entry));
-	_mult		= calloc(1, sizeof(struct word_entry));
-	_div		= calloc(1, sizeof(struct word_entry));
-	_ne		= calloc(1, sizeof(struct word_entry));
-	_dup		= calloc(1, sizeof(struct word_entry));
-	_drop		= calloc(1, sizeof(struct word_entry));
-	_nip		= calloc(1, sizeof(struct word_entry));
-	_negate		= calloc(1, sizeof(struct word_entry));
-	_dot		= calloc(1, sizeof(struct word_entry));
-	_here		= calloc(1, sizeof(struct word_entry));
-	_i		= calloc(1, sizeof(struct word_entry));
-	_over		= calloc(1, sizeof(struct word_entry));
+	current_resolution = NULL;
 
-	if (!(_comma && _load && _loads && _forth && _macro && _exit
-			&& _store && _fetch && _add && _one_complement
-			&& _mult && _div && _ne && _dup && _drop && _nip
-			&& _negate && _dot && _here && _i && _over))
-	{
-		fprintf(stderr, "Error: Not enough memory!\n");
-		free(code_here);
-		exit(EXIT_FAILURE);
-	}
+#ifdef PROFILE_WORDS
+	nb_call_frames = 0;
+#endif
+}
 
-	_comma->name		= pack(",");
-	_comma->code_address	= comma;
-	_comma->codeword	= &(_comma->code_address);
+enum stack_fault
+{
+	NO_STACK_FAULT,
+	DATA_STACK_UNDERFLOW,
+	DATA_STACK_OVERFLOW,
+	RETURN_STACK_UNDERFLOW,
+	RETURN_STACK_OVERFLOW,
+	INTERRUPTED,
+	OUT_OF_FUEL
+};
 
-	_load->name		= pack("load");
-	_load->code_address	= load;
-	_load->codeword		= &(_load->code_address);
+static const char *stack_fault_message[] = {
+	"",
+	"data stack underflow",
+	"data stack overflow",
+	"return stack underflow",
+	"return stack overflow",
+	"interrupted",
+	"out of fuel"
+};
 
-	_loads->name		= pack("loads");
-	_loads->code_address	= loads;
-	_loads->codeword	= &(_loads->code_address);
+static enum stack_fault
+guard_page_hit(const struct guarded_stack *area, const char *address,
+		const enum stack_fault underflow)
+{
+	if (address >= (char *)area->mapping && address < area->low_guard_end)
+		return underflow;
 
-	_forth->name		= pack("forth");
-	_forth->code_address	= forth;
-	_forth->codeword	= &(_forth->code_address);
+	if (address >= area->high_guard
+			&& address < (char *)area->mapping + area->length)
+		return underflow + 1;
 
-	_macro->name		= pack("macro");
-	_macro->code_address	= macro;
-	_macro->codeword	= &(_macro->code_address);
+	return NO_STACK_FAULT;
+}
 
-	_exit->name		= pack(";");
-	_exit->code_address	= exit_definition;
-	_exit->codeword		= &(_exit->code_address);
+static void
+stack_fault_handler(int signum, siginfo_t *info, void *context)
+{
+	enum stack_fault fault;
+	(void)context;
 
-	_store->name		= pack("!");
-	_store->code_address	= store;
-	_store->codeword	= &(_store->code_address);
+	fault = guard_page_hit(&tasks[current_task].data_area, info->si_addr,
+			DATA_STACK_UNDERFLOW);
 
-	_fetch->name		= pack("@");
-	_fetch->code_address	= fetch;
-	_fetch->codeword	= &(_fetch->code_address);
+	if (fault == NO_STACK_FAULT)
+		fault = guard_page_hit(&tasks[current_task].return_area, info->si_addr,
+				RETURN_STACK_UNDERFLOW);
 
-	_add->name		= pack("+");
-	_add->code_address	= add;
-	_add->codeword		= &(_add->code_address);
+	if (fault != NO_STACK_FAULT && is_recovery_armed)
+	{
+		last_stack_fault = fault;
+		siglongjmp(stack_fault_recovery, 1);
+	}
 
-	_one_complement->name		= pack("-");
-	_one_complement->code_address	= one_complement;
-	_one_complement->codeword	= &(_one_complement->code_address);
+	// Not a stack fault: the access is retried and kills us as usual
+	signal(signum, SIG_DFL);
+}
 
-	_mult->name		= pack("*");
-	_mult->code_address	= multiply;
-	_mult->codeword		= &(_mult->code_address);
+// Native calls run on the machine stack, their depth is checked instead.
+// An interrupt puts the limit out of reach to get here as well.
+static void
+native_stack_overflow(void)
+{
+	if (is_interrupt_requested)
+		interrupt();
 
-	_div->name		= pack("/");
-	_div->code_address	= divide;
-	_div->codeword		= &(_div->code_address);
+	last_stack_fault = RETURN_STACK_OVERFLOW;
+	siglongjmp(stack_fault_recovery, 1);
+}
 
-	_ne->name		= pack("ne");
-	_ne->code_address	= ne;
+/*
+ * Stop the running word from another thread, it unwinds back to the
+ * outermost call like a stack fault.
+ */
+void
+colorforth_interrupt(void)
+{
+	__atomic_store_n(&is_interrupt_requested, 1, __ATOMIC_RELEASE);
 
-	_dup->name		= pack("dup");
-	_dup->code_address	= dup_word;
-	_dup->codeword		= &(_dup->code_address);
+	// Native code only checks on the slow path of its depth check
+	__atomic_store_n(&native_stack_limit, ULONG_MAX, __ATOMIC_RELEASE);
+}
 
-	_drop->name		= pack("drop");
-	_drop->code_address	= drop;
-	_drop->codeword		= &(_drop->code_address);
+static void
+interrupt(void)
+{
+	is_interrupt_requested = 0;
 
-	_nip->name		= pack("nip");
-	_nip->code_address	= nip;
-	_nip->codeword		= &(_nip->code_address);
+	if (is_recovery_armed)
+	{
+		last_stack_fault = INTERRUPTED;
+		siglongjmp(stack_fault_recovery, 1);
+	}
+}
+
+// True when another task was switched in, its cell runs instead
+static bool
+out_of_fuel(const bool is_in_next)
+{
+	fuel = fuel_budget ? fuel_budget : LONG_MAX;
+
+	if (!fuel_budget || !is_recovery_armed)
+		return false;
+
+	// A task is preempted, the cell that ran out runs again on its turn
+	if (is_in_next && current_task && next_depth == task_depth)
+	{
+		IP--;
+		pause_word();
+		return true;
+	}
+
+	// Nothing but the cells of that definition is left to resume
+	if (is_in_next && is_resumable && next_depth == 1 && !current_task
+			&& block_depth <= 1)
+	{
+		suspended.is_suspended = true;
+		suspended.block        = block_depth ? outer_block : -1;
+		suspended.position     = outer_position;
+		suspended.IP           = IP - 1;
+	}
+
+	last_stack_fault = OUT_OF_FUEL;
+	siglongjmp(stack_fault_recovery, 1);
+}
+
+/*
+ * Task switching
+ */
+static void
+task_save(struct task *task)
+{
+	task->stack  = stack;
+	task->tos    = tos;
+	task->rstack = rstack;
+	task->rtos   = rtos;
+	task->IP     = IP;
+}
+
+static void
+task_load(const int n)
+{
+	struct task *task = &tasks[n];
+
+	stack  = task->stack;
+	tos    = task->tos;
+	rstack = task->rstack;
+	rtos   = task->rtos;
+	IP     = task->IP;
+
+	current_task = n;
+	task_switches++;
+}
+
+static void
+task_unlink(const int n)
+{
+	int previous = n;
+
+	while (tasks[previous].next != n)
+		previous = tasks[previous].next;
+
+	tasks[previous].next = tasks[n].next;
+	tasks[n].is_used = false;
+}
+
+// The word of the running task returned, the next task runs
+static void
+task_end(void)
+{
+	int n = current_task;
+
+	task_unlink(n);
+	task_load(tasks[n].next);
+}
+
+// After a fault or an interrupt, the task running is dropped
+static void
+task_recover(void)
+{
+	next_depth = 0;
+	is_host_waiting = false;
+
+	if (!current_task)
+		return;
+
+	fprintf(stderr, "Error: task %d stopped!\n", current_task);
+	task_unlink(current_task);
+	task_load(0);
+}
+
+unsigned long
+task_switch_count(void)
+{
+	return task_switches;
+}
+
+static void
+pause_word(void)
+{
+	int next = tasks[current_task].next;
+
+	// A task can only be left from the loop it runs in, not from a
+	// word run by a block it loads, its C frames would be left behind.
+	// The host needs a loop too, native code has none.
+	if (next == current_task || (current_task && next_depth != task_depth)
+			|| !next_depth)
+		return;
+
+	if (!current_task)
+		task_depth = next_depth;
+
+	task_save(&tasks[current_task]);
+	task_load(next);
+}
+
+static unsigned long host_return[1];
+
+// Resumes the host, which was running C code
+static void
+host_resume(void)
+{
+	if (is_host_waiting && tasks[0].next != 0)
+	{
+		IP = host_return;
+		pause_word();
+		return;
+	}
+
+	IP = NULL;
+}
+
+static unsigned long host_return[1] = { (unsigned long)host_resume };
+
+/*
+ * Round-robin from the outer interpreter: the host pauses, the other
+ * tasks run until it gets its turn again.
+ */
+static void
+run_tasks(void)
+{
+	unsigned long *caller = IP;
+
+	if (current_task || tasks[0].next == 0)
+		return;
+
+	IP = host_return;
+	next_depth++;
+	pause_word();
+	NEXT();
+	next_depth--;
+
+	IP = caller;
+}
+
+// The host gives its turns away until no other task is left
+static void
+wait_word(void)
+{
+	is_host_waiting = true;
+	run_tasks();
+	is_host_waiting = false;
+}
+
+/*
+ * Only the outermost call from the host sets the recovery point, a stack
+ * fault anywhere below unwinds everything back to it.
+ */
+static void
+run_guarded(void (*action)(const cell_t), const cell_t argument)
+{
+	if (is_recovery_armed)
+	{
+		action(argument);
+		return;
+	}
+
+	// Its return stack is kept until it is resumed or dropped
+	if (suspended.is_suspended && action != resume_suspended)
+	{
+		fprintf(stderr, "Error: A run is suspended, resume or drop it!\n");
+		return;
+	}
+
+	// An interrupt only stops what was running when it was requested
+	is_interrupt_requested = 0;
+	fuel = fuel_budget ? fuel_budget : LONG_MAX;
+	suspended.is_suspended = false;
+
+	if (sigsetjmp(stack_fault_recovery, 1) == 0)
+	{
+		is_recovery_armed = 1;
+
+		// As deep as the return stack, a native call takes 16 bytes
+		native_stack_limit = (unsigned long)__builtin_frame_address(0)
+			- STACK_SIZE * 16;
+		action(argument);
+	}
+	else if (suspended.is_suspended)
+	{
+		next_depth         = 0;
+		block_depth        = 0;
+		current_resolution = NULL;
+	}
+	else
+	{
+		fprintf(stderr, "Error: %s!\n", stack_fault_message[last_stack_fault]);
+		task_recover();
+		block_depth = 0;
+		stack_reset();
+	}
+
+	is_recovery_armed  = 0;
+	native_stack_limit = 0;
+}
+
+static void
+interpret_word(const cell_t word)
+{
+	uint8_t color = (int)word & 0x0000000f;
+
+	if (color == 2 || color == 5 || color == 6 || color == 8 || color == 15)
+	{
+		printf("Color = %1d, Word = %10d, packed = %8x\n",
+				color, word >> 5, word);
+	}
+	else if (color != 0)
+	{
+		printf("Color = %1d, Word = %10s, packed = %8x\n",
+				color, unpack(word), word);
+	}
+
+	(*color_word_action[color])(word);
+	run_tasks();
+}
+
+void
+do_word(const cell_t word)
+{
+	run_guarded(interpret_word, word);
+}
+
+static void
+interpret_block_from(const cell_t n, const unsigned int first)
+{
+	unsigned int nb_cells;
+	const cell_t *cells;
+
+	struct resolution *slots  = block_resolution_slots(n);
+	struct resolution *caller = current_resolution;
+
+	cells = block_cells(n, &nb_cells);
+
+	if (block_depth++ == 0)
+		outer_block = n;
+
+	for (unsigned int i = first; i < nb_cells && i < BLOCK_CELLS - 1; i++)
+	{
+		if (block_depth == 1)
+			outer_position = i;
+
+		current_resolution = &slots[i];
+		interpret_word(cells[i]);
+	}
+
+	block_depth--;
+	current_resolution = caller;
+}
+
+static void
+interpret_block(const cell_t n)
+{
+	interpret_block_from(n, 0);
+}
+
+void
+run_block(const cell_t n)
+{
+	run_guarded(interpret_block, n);
+}
+
+// Budget of each following run, 0 for no limit
+void
+set_fuel(const long budget)
+{
+	fuel_budget = budget > 0 ? budget : 0;
+}
+
+bool
+is_run_suspended(void)
+{
+	return suspended.is_suspended;
+}
+
+// The suspended definition runs to its end, then the rest of its block
+static void
+resume_suspended(const cell_t n)
+{
+	unsigned int position = suspended.position;
+
+	IP = suspended.IP;
+	is_resumable = true;
+	block_depth  = n != -1;
+	outer_block  = n;
+	outer_position = position;
+
+	next_depth++;
+	NEXT();
+	next_depth--;
+
+	IP = NULL;
+	is_resumable = false;
+	block_depth  = 0;
+	run_tasks();
+
+	if (n != -1)
+		interpret_block_from(n, position + 1);
+}
+
+// Resume with a new budget, the run may be suspended again
+void
+resume_run(void)
+{
+	cell_t n = suspended.block;
+
+	if (!suspended.is_suspended)
+		return;
+
+	run_guarded(resume_suspended, n);
+}
+
+// Give up the suspended run, what it left on the data stack stays
+void
+drop_run(void)
+{
+	if (!suspended.is_suspended)
+		return;
+
+	suspended.is_suspended = false;
+	rtos = start_of(rstack);
+}
+
+// Interpret a block again after it changed, if it was loaded before
+void
+reload_block(const cell_t n)
+{
+	if (n < nb_block_resolutions && block_resolutions[n])
+		run_block(n);
+}
+
+struct word_entry *
+lookup_word(cell_t name, const bool force_dictionary)
+{
+	struct word_entry *item;
+
+	name &= 0xfffffff0; // Don't care about the color byte
+	printf("Lookup : %x\n", name);
+
+	if (force_dictionary == FORTH_DICTIONARY)
+	{
+		LIST_FOREACH(item, &forth_dictionary, next)
+		{
+			if (name == item->name)
+				return item;
+		}
+	}
+	else
+	{
+		LIST_FOREACH(item, &macro_dictionary, next)
+		{
+			if (name == item->name)
+				return item;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Constant folding
+ *
+ * The last literals compiled, with nothing compiled after them, are kept
+ * in a window. A call to one of the pure primitives below taking all its
+ * inputs from the window runs at compile time instead, the literals are
+ * replaced by its results. Running words or macros closes the window,
+ * they may leave a branch target between two literals.
+ */
+#define FOLD_WINDOW 8
+
+static const struct
+{
+	FUNCTION_EXEC code;
+	int           nb_inputs;
+	bool          is_division;	// Not folded by zero
+} foldable[] = {
+	{ add,			2, false },
+	{ one_complement,	2, false },
+	{ multiply,		2, false },
+	{ divide,		2, true },
+	{ negate,		1, false },
+	{ ne,			2, false },
+	{ dup_word,		1, false },
+	{ drop,			1, false },
+	{ nip,			2, false },
+	{ over,			2, false },
+	{ lt,			2, false },
+	{ gt,			2, false },
+	{ le,			2, false },
+	{ ge,			2, false },
+	{ eq,			2, false },
+};
+
+static struct
+{
+	long           values[FOLD_WINDOW];
+	unsigned long *starts[FOLD_WINDOW];		// Of each literal
+	unsigned char *native_starts[FOLD_WINDOW];
+	unsigned long *end;				// Right after the last one
+	unsigned char *native_end;
+	int            nb_literals;
+} pending;
+
+static void compile_literal(const long n);
+
+static void
+fold_reset(void)
+{
+	pending.nb_literals = 0;
+}
+
+// Called right before a literal is compiled
+static void
+fold_push(const long n)
+{
+	if (h != pending.end || native_here != pending.native_end)
+		pending.nb_literals = 0;
+
+	if (pending.nb_literals == FOLD_WINDOW)
+	{
+		memmove(&pending.values[0], &pending.values[1],
+				(FOLD_WINDOW - 1) * sizeof(pending.values[0]));
+		memmove(&pending.starts[0], &pending.starts[1],
+				(FOLD_WINDOW - 1) * sizeof(pending.starts[0]));
+		memmove(&pending.native_starts[0], &pending.native_starts[1],
+				(FOLD_WINDOW - 1) * sizeof(pending.native_starts[0]));
+		pending.nb_literals--;
+	}
+
+	pending.values[pending.nb_literals]        = n;
+	pending.starts[pending.nb_literals]        = h;
+	pending.native_starts[pending.nb_literals] = native_here;
+	pending.nb_literals++;
+}
+
+// Returns true when the call was replaced by literals
+static bool
+fold_call(const void *code)
+{
+	long results[FOLD_WINDOW + 1];
+	long *saved_tos = tos;
+	int first, nb_results;
+	size_t i;
+
+	if (h != pending.end || native_here != pending.native_end)
+		pending.nb_literals = 0;
+
+	for (i = 0; i < sizeof(foldable) / sizeof(foldable[0]); i++)
+		if (code == foldable[i].code)
+			break;
+
+	if (i == sizeof(foldable) / sizeof(foldable[0])
+			|| pending.nb_literals < foldable[i].nb_inputs
+			|| (foldable[i].is_division
+				&& !pending.values[pending.nb_literals - 1]))
+		return false;
+
+	// Run it on top of the compile time stack, then take its results back
+	first = pending.nb_literals - foldable[i].nb_inputs;
+
+	for (int j = first; j < pending.nb_literals; j++)
+		stack_push(pending.values[j]);
+
+	foldable[i].code();
+	nb_results = tos - saved_tos;
+
+	for (int j = 0; j < nb_results; j++)
+		results[j] = saved_tos[j + 1];
+
+	tos = saved_tos;
+
+	// Results must be literals again
+	for (int j = 0; j < nb_results; j++)
+		if (first + j >= FOLD_WINDOW
+				|| (long)((unsigned long)results[j] << 5) >> 5 != results[j])
+			return false;
+
+	h           = pending.starts[first];
+	native_here = pending.native_starts[first];
+	pending.nb_literals = first;
+
+	for (int j = 0; j < nb_results; j++)
+		compile_literal(results[j]);
+
+	pending.end        = h;
+	pending.native_end = native_here;
+
+	return true;
+}
+
+/*
+ * Inlining
+ *
+ * At ';', the body of a definition short enough, without control flow
+ * and which didn't run words while being compiled, is copied aside. Calls
+ * to it then copy that body instead, threaded bodies go through constant
+ * folding again. Words calling the return stack primitives are always
+ * called, their return stack is the callee's one. noinl keeps the last
+ * definition called, .inl lists the inlined call sites.
+ */
+struct inline_site
+{
+	const struct word_entry *callee;
+	const struct word_entry *caller;
+	void                    *address;
+};
+
+static struct word_entry  *current_definition;	// Last one created
+static bool                is_definition_inlinable;
+static struct inline_site *inline_sites;
+static size_t              nb_inline_sites;
+static size_t              inline_sites_size;
+
+static void
+inline_record(void)
+{
+	struct word_entry *word = current_definition;
+	unsigned char *body;
+	size_t size;
+
+	if (!word || !is_definition_inlinable || word->is_inline_disabled)
+		return;
+
+	// Only the first ';' of a definition ends its body
+	is_definition_inlinable = false;
+
+#ifdef PROFILE_WORDS
+	// Every call is counted
+	return;
+#endif
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		body = (unsigned char *)word->code_address + NATIVE_PROLOGUE_SIZE;
+		size = native_here - body;
+
+		if (size > INLINE_MAX_BYTES)
+			return;
+
+		word->is_inline_tail_call = last_native_call
+			&& last_native_call + NATIVE_CALL_SIZE == native_here;
+	}
+	else
+	{
+		body = word->code_address;
+		size = (unsigned char *)h - body;
+
+		if (size > INLINE_MAX_CELLS * sizeof(*h))
+			return;
+	}
+
+	memcpy(word->inline_body, body, size);
+	word->inline_size = size;
+}
+
+static void
+remember_inline_site(const struct word_entry *callee, void *address)
+{
+	if (nb_inline_sites == inline_sites_size)
+	{
+		inline_sites_size = inline_sites_size ? inline_sites_size * 2 : 64;
+		inline_sites = realloc(inline_sites,
+				inline_sites_size * sizeof(*inline_sites));
+
+		if (!inline_sites)
+		{
+			fprintf(stderr, "Error: Not enough memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	inline_sites[nb_inline_sites].callee  = callee;
+	inline_sites[nb_inline_sites].caller  = current_definition;
+	inline_sites[nb_inline_sites].address = address;
+	nb_inline_sites++;
+}
+
+// Returns true when the body was copied instead of compiling a call
+static bool
+inline_call(const struct word_entry *word)
+{
+	const unsigned long *cell, *end;
+
+	if (!word->inline_size || word->is_inline_disabled)
+		return false;
+
+	// Bodies are only copied into code of the same kind
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		if (word->code_address < (void *)native_heap
+				|| word->code_address >= (void *)(native_heap + NATIVE_HEAP_SIZE))
+			return false;
+
+		remember_inline_site(word, native_here);
+		emit(word->inline_body, word->inline_size);
+		last_native_call = word->is_inline_tail_call
+			? native_here - NATIVE_CALL_SIZE : NULL;
+		return true;
+	}
+
+	if (word->code_address < (void *)code_here
+			|| word->code_address >= (void *)(code_here + CODE_HEAP_SIZE / sizeof(*h)))
+		return false;
+
+	remember_inline_site(word, h);
+	cell = (const unsigned long *)word->inline_body;
+	end  = cell + word->inline_size / sizeof(*cell);
+
+	while (cell < end)
+	{
+		unsigned long function = *cell++;
+
+		if (function == (unsigned long)literal)
+		{
+			compile_literal((long)*cell++ >> 5);
+			continue;
+		}
+
+		if (fold_call((void *)function))
+			continue;
+
+		if (function == (unsigned long)call_aux)
+			last_call = h;
+
+		stack_push(function);
+		comma();
+
+		if (function == (unsigned long)call_aux)
+		{
+			stack_push(*cell++);
+			comma();
+		}
+	}
+
+	return true;
+}
+
+// Words reading or changing the return stack must stay calls
+static bool
+is_return_stack_word(const void *code)
+{
+	return code == rdrop || code == i_word;
+}
+
+void noinl(void)
+{
+	if (!current_definition)
+		return;
+
+	current_definition->is_inline_disabled = true;
+	current_definition->inline_size = 0;
+}
+
+void dot_inl(void)
+{
+	// unpack() reuses its buffer, names are printed one at a time
+	for (size_t i = 0; i < nb_inline_sites; i++)
+	{
+		printf("%s inlined in ", unpack(inline_sites[i].callee->name));
+		printf("%s at %p\n", inline_sites[i].caller
+				? unpack(inline_sites[i].caller->name) : "?",
+				inline_sites[i].address);
+	}
+
+	printf("%zu call sites inlined\n", nb_inline_sites);
+}
+
+static void
+insert_builtins_into_forth_dictionary(void)
+{
+	struct word_entry *_comma, *_load, *_loads, *_forth, *_macro,
+		*_store, *_fetch, *_add, *_one_complement, *_mult,
+		*_div, *_ne, *_dup, *_drop, *_nip, *_negate, *_dot, *_here, *_i,
+		*_over, *_see, *_noinl, *_dot_inl, *_lt, *_gt, *_le, *_ge, *_eq,
+		*_pause, *_task, *_wait, *_where, *_uses;
+
+	_comma		= calloc(1, sizeof(struct word_entry));
+	_load		= calloc(1, sizeof(struct word_entry));
+	_loads		= calloc(1, sizeof(struct word_entry));
+	_forth		= calloc(1, sizeof(struct word_entry));
+	_macro		= calloc(1, sizeof(struct word_entry));
+	_store		= calloc(1, sizeof(struct word_entry));
+	_fetch		= calloc(1, sizeof(struct word_entry));
+	_add		= calloc(1, sizeof(struct word_entry));
+	_one_complement	= calloc(1, sizeof(struct word_entry));
+	_mult		= calloc(1, sizeof(struct word_entry));
+	_div		= calloc(1, sizeof(struct word_entry));
+	_ne		= calloc(1, sizeof(struct word_entry));
+	_dup		= calloc(1, sizeof(struct word_entry));
+	_drop		= calloc(1, sizeof(struct word_entry));
+	_nip		= calloc(1, sizeof(struct word_entry));
+	_negate		= calloc(1, sizeof(struct word_entry));
+	_dot		= calloc(1, sizeof(struct word_entry));
+	_here		= calloc(1, sizeof(struct word_entry));
+	_i		= calloc(1, sizeof(struct word_entry));
+	_over		= calloc(1, sizeof(struct word_entry));
+	_see		= calloc(1, sizeof(struct word_entry));
+	_noinl		= calloc(1, sizeof(struct word_entry));
+	_dot_inl	= calloc(1, sizeof(struct word_entry));
+	_lt		= calloc(1, sizeof(struct word_entry));
+	_gt		= calloc(1, sizeof(struct word_entry));
+	_le		= calloc(1, sizeof(struct word_entry));
+	_ge		= calloc(1, sizeof(struct word_entry));
+	_eq		= calloc(1, sizeof(struct word_entry));
+	_pause		= calloc(1, sizeof(struct word_entry));
+	_task		= calloc(1, sizeof(struct word_entry));
+	_wait		= calloc(1, sizeof(struct word_entry));
+	_where		= calloc(1, sizeof(struct word_entry));
+	_uses		= calloc(1, sizeof(struct word_entry));
+
+	if (!(_comma && _load && _loads && _forth && _macro
+			&& _store && _fetch && _add && _one_complement
+			&& _mult && _div && _ne && _dup && _drop && _nip
+			&& _negate && _dot && _here && _i && _over && _see
+			&& _noinl && _dot_inl && _lt && _gt && _le && _ge && _eq
+			&& _pause && _task && _wait && _where && _uses))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		free(code_here);
+		exit(EXIT_FAILURE);
+	}
+
+	_comma->name		= pack(",");
+	_comma->code_address	= comma;
+	_comma->codeword	= &(_comma->code_address);
+
+	_load->name		= pack("load");
+	_load->code_address	= load;
+	_load->codeword		= &(_load->code_address);
+
+	_loads->name		= pack("loads");
+	_loads->code_address	= loads;
+	_loads->codeword	= &(_loads->code_address);
+
+	_forth->name		= pack("forth");
+	_forth->code_address	= forth;
+	_forth->codeword	= &(_forth->code_address);
+
+	_macro->name		= pack("macro");
+	_macro->code_address	= macro;
+	_macro->codeword	= &(_macro->code_address);
+
+	_store->name		= pack("!");
+	_store->code_address	= store;
+	_store->codeword	= &(_store->code_address);
+
+	_fetch->name		= pack("@");
+	_fetch->code_address	= fetch;
+	_fetch->codeword	= &(_fetch->code_address);
+
+	_add->name		= pack("+");
+	_add->code_address	= add;
+	_add->codeword		= &(_add->code_address);
+
+	_one_complement->name		= pack("-");
+	_one_complement->code_address	= one_complement;
+	_one_complement->codeword	= &(_one_complement->code_address);
+
+	_mult->name		= pack("*");
+	_mult->code_address	= multiply;
+	_mult->codeword		= &(_mult->code_address);
+
+	_div->name		= pack("/");
+	_div->code_address	= divide;
+	_div->codeword		= &(_div->code_address);
+
+	_ne->name		= pack("ne");
+	_ne->code_address	= ne;
+	_ne->codeword		= &(_ne->code_address);
+
+	_dup->name		= pack("dup");
+	_dup->code_address	= dup_word;
+	_dup->codeword		= &(_dup->code_address);
+
+	_drop->name		= pack("drop");
+	_drop->code_address	= drop;
+	_drop->codeword		= &(_drop->code_address);
+
+	_nip->name		= pack("nip");
+	_nip->code_address	= nip;
+	_nip->codeword		= &(_nip->code_address);
 
 	_over->name		= pack("over");
 	_over->code_address	= over;
 	_over->codeword		= &(_over->code_address);
 
-	_negate->name		= pack("negate");
-	_negate->code_address	= negate;
-	_negate->codeword	= &(_negate->code_address);
+	_negate->name		= pack("negate");
+	_negate->code_address	= negate;
+	_negate->codeword	= &(_negate->code_address);
+
+	_dot->name		= pack(".");
+	_dot->code_address	= dot;
+	_dot->codeword		= &(_dot->code_address);
+
+	_here->name		= pack("here");
+	_here->code_address	= here;
+	_here->codeword		= &(_here->code_address);
+
+	_i->name		= pack("i");
+	_i->code_address	= i_word;
+	_i->codeword		= &(_i->code_address);
+
+	_see->name		= pack("see");
+	_see->code_address	= see;
+	_see->codeword		= &(_see->code_address);
+
+	_noinl->name		= pack("noinl");
+	_noinl->code_address	= noinl;
+	_noinl->codeword	= &(_noinl->code_address);
+
+	_dot_inl->name		= pack(".inl");
+	_dot_inl->code_address	= dot_inl;
+	_dot_inl->codeword	= &(_dot_inl->code_address);
+
+	_lt->name		= pack("lt");
+	_lt->code_address	= lt;
+	_lt->codeword		= &(_lt->code_address);
+
+	_gt->name		= pack("gt");
+	_gt->code_address	= gt;
+	_gt->codeword		= &(_gt->code_address);
+
+	_le->name		= pack("le");
+	_le->code_address	= le;
+	_le->codeword		= &(_le->code_address);
+
+	_ge->name		= pack("ge");
+	_ge->code_address	= ge;
+	_ge->codeword		= &(_ge->code_address);
+
+	_eq->name		= pack("eq");
+	_eq->code_address	= eq;
+	_eq->codeword		= &(_eq->code_address);
+
+	_pause->name		= pack("pause");
+	_pause->code_address	= pause_word;
+	_pause->codeword	= &(_pause->code_address);
+
+	_task->name		= pack("task");
+	_task->code_address	= task_word;
+	_task->codeword		= &(_task->code_address);
+
+	_wait->name		= pack("wait");
+	_wait->code_address	= wait_word;
+	_wait->codeword		= &(_wait->code_address);
+
+	_where->name		= pack("where");
+	_where->code_address	= where;
+	_where->codeword	= &(_where->code_address);
+
+	_uses->name		= pack("uses");
+	_uses->code_address	= uses;
+	_uses->codeword		= &(_uses->code_address);
+
+	LIST_INSERT_HEAD(&forth_dictionary, _comma,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _load,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _loads,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _forth,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _macro,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _store,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _fetch,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _add,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _one_complement,	next);
+	LIST_INSERT_HEAD(&forth_dictionary, _mult,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _div,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _ne,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _dup,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _drop,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _nip,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _negate,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _dot,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _here,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _i,			next);
+	LIST_INSERT_HEAD(&forth_dictionary, _over,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _see,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _noinl,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _dot_inl,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _lt,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _gt,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _le,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _ge,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _eq,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _pause,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _task,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _wait,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _where,		next);
+	LIST_INSERT_HEAD(&forth_dictionary, _uses,		next);
+
+#ifdef PROFILE_WORDS
+	struct word_entry *_prof = calloc(1, sizeof(struct word_entry));
+
+	if (!_prof)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		free(code_here);
+		exit(EXIT_FAILURE);
+	}
+
+	_prof->name		= pack(".prof");
+	_prof->code_address	= dot_prof;
+	_prof->codeword		= &(_prof->code_address);
+
+	LIST_INSERT_HEAD(&forth_dictionary, _prof,		next);
+#endif
+}
+
+static void
+insert_builtins_into_macro_dictionary(void)
+{
+	struct word_entry *_rdrop, *_swap, *_if, *_then, *_for, *_next,
+		*_semicolon, *_minus_if, *_else;
+
+	_rdrop	= calloc(1, sizeof(struct word_entry));
+	_swap	= calloc(1, sizeof(struct word_entry));
+	_if	= calloc(1, sizeof(struct word_entry));
+	_then	= calloc(1, sizeof(struct word_entry));
+	_for	= calloc(1, sizeof(struct word_entry));
+	_next	= calloc(1, sizeof(struct word_entry));
+	_semicolon	= calloc(1, sizeof(struct word_entry));
+	_minus_if	= calloc(1, sizeof(struct word_entry));
+	_else	= calloc(1, sizeof(struct word_entry));
+
+	if (!(_rdrop && _swap && _if && _then && _for && _next
+			&& _semicolon && _minus_if && _else))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		free(code_here);
+		exit(EXIT_FAILURE);
+	}
+
+	_rdrop->name		= pack("rdrop");
+	_rdrop->code_address	= rdrop;
+	_rdrop->codeword	= &(_rdrop->code_address);
+
+	_swap->name		= pack("swap");
+	_swap->code_address	= swap;
+	_swap->codeword		= &(_swap->code_address);
+
+	_if->name		= pack("if");
+	_if->code_address	= if_;
+	_if->codeword		= &(_if->code_address);
+
+	_then->name		= pack("then");
+	_then->code_address	= then;
+	_then->codeword		= &(_then->code_address);
+
+	_for->name		= pack("for");
+	_for->code_address	= for_;
+	_for->codeword		= &(_for->code_address);
+
+	_next->name		= pack("next");
+	_next->code_address	= next_;
+	_next->codeword		= &(_next->code_address);
+
+	_semicolon->name		= pack(";");
+	_semicolon->code_address	= semicolon;
+	_semicolon->codeword		= &(_semicolon->code_address);
+
+	_minus_if->name		= pack("-if");
+	_minus_if->code_address	= minus_if;
+	_minus_if->codeword	= &(_minus_if->code_address);
+
+	_else->name		= pack("else");
+	_else->code_address	= else_;
+	_else->codeword		= &(_else->code_address);
+
+	LIST_INSERT_HEAD(&macro_dictionary, _rdrop,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _swap,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _if,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _then,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _for,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _next,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _semicolon,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _minus_if,	next);
+	LIST_INSERT_HEAD(&macro_dictionary, _else,	next);
+}
+
+void
+literal(void)
+{
+	// Fetch the number from the next cell
+	long n = *(long *)IP++;
+	n >>= 5;  // Make it a number again ;-)
+
+	// Push the number on the stack
+	stack_push(n);
+}
+
+void
+variable(void)
+{
+	stack_push((long)IP); // The variable's value is in the next cell
+	exit_definition();
+}
+
+/*
+ * Colon definitions and variables all share this code field, the body
+ * of the word being run is found through W. Native definitions are
+ * called directly like primitives.
+ */
+
+static void
+enter_definition(void)
+{
+	unsigned long *caller = IP;
+
+	// The outermost ';' returns to a null IP, which stops NEXT
+	rpush((unsigned long)NULL);
+#ifdef PROFILE_WORDS
+	open_call_frame(NULL); // execute() counts this one
+#endif
+	IP = W->code_address;
+	next_depth++;
+	NEXT();
+	next_depth--;
+
+	IP = caller;
+}
+
+static FUNCTION_EXEC definition_codeword = enter_definition;
+
+static bool
+is_definition(const struct word_entry *word)
+{
+	return word->codeword == &definition_codeword;
+}
+
+#ifdef PROFILE_WORDS
+void
+counted_execute(struct word_entry *word)
+{
+	uint64_t start = read_cycles();
+
+	W = word;
+	(*(FUNCTION_EXEC *)word->codeword)();
+
+	word->calls++;
+	word->cycles += read_cycles() - start;
+}
+#endif
+
+static void
+execute(struct word_entry *word)
+{
+	printf("EXEC: %s at %p\n", unpack(word->name), word->code_address);
+	fold_reset();
+#ifdef PROFILE_WORDS
+	counted_execute(word);
+#else
+	bool is_outermost = !next_depth && !current_task;
+
+	// Only a definition run from the outer interpreter can be suspended
+	if (is_outermost)
+		is_resumable = is_definition(word);
+
+	W = word;
+	(*(FUNCTION_EXEC *)word->codeword)();
+
+	if (is_outermost)
+		is_resumable = false;
+#endif
+}
+
+static void
+compile_native_call(const struct word_entry *word)
+{
+#ifdef PROFILE_WORDS
+	emit_imm64((const unsigned char []){0x48, 0xbf}, (unsigned long)word); // mov rdi
+	native_call(counted_execute);
+#else
+	if (is_definition(word))
+	{
+		// Threaded definition: set W and go through its code field
+		emit_imm64((const unsigned char []){0x48, 0xba}, (unsigned long)&W);
+		emit_imm64((const unsigned char []){0x48, 0xb8}, (unsigned long)word);
+		emit((const unsigned char []){0x48, 0x89, 0x02}, 3); // mov [rdx], rax
+		native_call(enter_definition);
+		return;
+	}
+
+	native_call(word->code_address);
+#endif
+}
+
+static void
+compile_call(const struct word_entry *word)
+{
+	if (fold_call(word->code_address) || inline_call(word))
+	{
+		last_compare = NULL;
+		return;
+	}
+
+	compile_compare(word->code_address);
+
+	if (is_return_stack_word(word->code_address))
+		is_definition_inlinable = false;
 
-	_dot->name		= pack(".");
-	_dot->code_address	= dot;
-	_dot->codeword		= &(_dot->code_address);
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		compile_native_call(word);
+		return;
+	}
 
-	_here->name		= pack("here");
-	_here->code_address	= here;
-	_here->codeword		= &(_here->code_address);
+#ifdef PROFILE_WORDS
+	stack_push(is_definition(word) ? (long)counted_call_aux
+			: (long)counted_primitive);
+	comma();
 
-	_i->name		= pack("i");
-	_i->code_address	= i_word;
-	_i->codeword		= &(_i->code_address);
+	stack_push((long)word);
+	comma();
+#else
+	if (is_definition(word))
+	{
+		last_call = h;
 
-	LIST_INSERT_HEAD(&forth_dictionary, _comma,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _load,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _loads,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _forth,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _macro,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _exit,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _store,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _fetch,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _add,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _one_complement,	next);
-	LIST_INSERT_HEAD(&forth_dictionary, _mult,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _div,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _ne,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _dup,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _drop,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _nip,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _negate,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _dot,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _here,		next);
-	LIST_INSERT_HEAD(&forth_dictionary, _i,			next);
-	LIST_INSERT_HEAD(&forth_dictionary, _over,		next);
+		stack_push((long)call_aux);
+		comma();
+	}
+
+	stack_push((long)word->code_address);
+	comma();
+#endif
 }
 
+/*
+ * Colorful words handling
+ */
 static void
-insert_builtins_into_macro_dictionary(void)
+ignore(const cell_t word)
+{
+	(void)word; // Avoid an useless warning and do nothing!
+}
+
+static void
+interpret_forth_word(const cell_t word)
 {
-	struct word_entry *_rdrop, *_ne, *_swap, *_if, *_then, *_for, *_next;
+	struct resolution *slot = resolution_slot(word);
+	struct word_entry *entry = slot->entry;
 
-	_rdrop	= calloc(1, sizeof(struct word_entry));
-	_ne	= calloc(1, sizeof(struct word_entry));
-	_swap	= calloc(1, sizeof(struct word_entry));
-	_if	= calloc(1, sizeof(struct word_entry));
-	_then	= calloc(1, sizeof(struct word_entry));
-	_for	= calloc(1, sizeof(struct word_entry));
-	_next	= calloc(1, sizeof(struct word_entry));
+	if (next_word_consumer)
+	{
+		void (*consumer)(const cell_t) = next_word_consumer;
+
+		next_word_consumer = NULL;
+		consumer(word);
+		return;
+	}
+
+	if (!is_resolved(slot, word))
+		entry = remember_resolution(slot, word,
+				lookup_word(word, FORTH_DICTIONARY), FORTH_DICTIONARY);
+
+	// What it compiles or where it branches isn't known
+	is_definition_inlinable = false;
+	last_compare            = NULL;
+
+	if (entry)
+		execute(entry);
+}
+
+static void
+interpret_big_number(const cell_t number)
+{
+	(void)number;
+}
+
+static void
+interpret_number(const cell_t number)
+{
+	stack_push(number >> 5);
+}
+
+static void
+compile_word(const cell_t word)
+{
+	struct resolution *slot = resolution_slot(word);
+
+	if (!is_resolved(slot, word))
+	{
+		struct word_entry *macro_entry = lookup_word(word, MACRO_DICTIONARY);
+
+		if (macro_entry)
+			remember_resolution(slot, word, macro_entry, MACRO_DICTIONARY);
+		else
+			remember_resolution(slot, word,
+				lookup_word(word, FORTH_DICTIONARY), FORTH_DICTIONARY);
+	}
+
+	struct word_entry *entry = slot->entry;
+
+	if (!entry)
+		return;
+
+	if (slot->dictionary == MACRO_DICTIONARY)
+	{
+		// Execute macro word
+		printf("Execute Macro: name = %s, code_address = %p\n",
+				unpack(entry->name), entry->code_address);
+
+		// Control flow, the first ';' records the body
+		if (entry->code_address != semicolon)
+			is_definition_inlinable = false;
+
+		execute(entry);
+	}
+	else
+	{
+		// Compile a call to that word
+		compile_call(entry);
+		printf("To compile: %s, %x, at address: %p\n", unpack(entry->name),
+				(int)entry->name, h);
+	}
+}
+
+static void
+compile_literal(const long n)
+{
+	fold_push(n);
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+		native_literal(n);
+	else
+	{
+		stack_push((long)literal);
+		comma();
+
+		stack_push((long)((unsigned long)n << 5));
+		comma();
+	}
+
+	pending.end        = h;
+	pending.native_end = native_here;
+}
+
+static void
+compile_number(const cell_t number)
+{
+	compile_literal(number >> 5);
+}
+
+static void
+compile_big_number(const cell_t number)
+{
+	(void)number;
+}
+
+static void
+compile_macro(const cell_t word)
+{
+	struct resolution *slot = resolution_slot(word);
+	struct word_entry *entry = slot->entry;
+
+	if (!is_resolved(slot, word))
+		entry = remember_resolution(slot, word,
+				lookup_word(word, MACRO_DICTIONARY), MACRO_DICTIONARY);
+
+	if (entry)
+	{
+		// Compile a call to that macro
+		printf("Macro: %s -> %lx\n", unpack(word), (unsigned long)entry->code_address);
+		compile_call(entry);
+	}
+}
+
+static void
+create_word(cell_t word)
+{
+	struct word_entry *entry = calloc(1, sizeof(struct word_entry));
 
-	if (!(_rdrop && _ne && _swap && _if && _then && _for && _next))
+	if (!entry)
 	{
 		fprintf(stderr, "Error: Not enough memory!\n");
-		free(code_here);
+		colorforth_finalize();
 		exit(EXIT_FAILURE);
 	}
 
-	_rdrop->name		= pack("rdrop");
-	_rdrop->code_address	= rdrop;
-	_rdrop->codeword	= &(_rdrop->code_address);
+	word &= 0xfffffff0;
+
+	// Earlier resolutions of this name may now be shadowed
+	name_generation[name_bucket(word)]++;
+
+	// Definitions can fall through into the next one, don't fold across
+	// nor turn the last call of the previous one into a jump
+	fold_reset();
+	last_call        = NULL;
+	last_native_call = NULL;
+
+	current_definition      = entry;
+	is_definition_inlinable = true;
+	last_compare            = NULL;
+
+	entry->name = word;
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		// Falling through from the previous definition leaves its frame
+		if (native_here != native_heap)
+			emit((const unsigned char []){0x48, 0x83, 0xc4, 0x08},
+					NATIVE_FALL_THROUGH_SIZE); // add rsp, 8
+
+		entry->code_address = native_here;
+		entry->codeword     = &(entry->code_address);
+		native_prologue();
+	}
+	else
+	{
+		entry->code_address = h;
+		entry->codeword     = &definition_codeword;
+	}
+
+	printf("create_word(): at %p, name = %x\n", entry->code_address,
+			(int)entry->name);
+
+	if (selected_dictionary == MACRO_DICTIONARY)
+		LIST_INSERT_HEAD(&macro_dictionary, entry, next);
+	else
+		LIST_INSERT_HEAD(&forth_dictionary, entry, next);
+
+	name_add(word);
+}
+
+static void
+variable_word(const cell_t word)
+{
+	// A variable must be defined in forth dictionary
+	forth();
+
+	create_word(word);
+	is_definition_inlinable = false;
+
+	if (compile_mode == SUBROUTINE_THREADED_CODE)
+	{
+		// The value lives in the code heap, the native code pushes its address
+		native_literal((long)h);
+		native_exit();
+
+		stack_push(0);
+		comma();
+		return;
+	}
+
+	// Variable's handler
+	stack_push((long)variable);
+	comma();
+
+	// The default value of a variable is 0 (green number)
+	stack_push(0);
+	comma();
+}
+
+/*
+ * Decompiler
+ *
+ * Walks a definition up to the start of the next one and names every
+ * cell: runtime helpers, dictionary entries, literals and branch targets.
+ * Native definitions are decoded from the instruction patterns the
+ * subroutine-threaded compiler emits.
+ */
+static const struct
+{
+	void       *address;
+	const char *name;
+} runtime_names[] = {
+	{ literal,		"literal" },
+	{ variable,		"variable" },
+	{ call_aux,		"call" },
+	{ jump_aux,		"jump" },
+	{ exit_definition,	";" },
+	{ zero_branch,		"zero_branch" },
+	{ zero_branch_test,	"zero_branch_test" },
+	{ minus_branch,		"minus_branch" },
+	{ minus_branch_test,	"minus_branch_test" },
+	{ lt_branch,		"lt_branch" },
+	{ lt_branch_test,	"lt_branch_test" },
+	{ gt_branch,		"gt_branch" },
+	{ gt_branch_test,	"gt_branch_test" },
+	{ le_branch,		"le_branch" },
+	{ le_branch_test,	"le_branch_test" },
+	{ ge_branch,		"ge_branch" },
+	{ ge_branch_test,	"ge_branch_test" },
+	{ eq_branch,		"eq_branch" },
+	{ eq_branch_test,	"eq_branch_test" },
+	{ ne_branch,		"ne_branch" },
+	{ ne_branch_test,	"ne_branch_test" },
+	{ for_aux,		"for_aux" },
+	{ next_aux,		"next_aux" },
+	{ next_test,		"next_test" },
+	{ enter_definition,	"enter_definition" },
+	{ task_end,		"task_end" },
+	{ host_resume,		"host_resume" },
+#ifdef PROFILE_WORDS
+	{ counted_call_aux,	"counted_call" },
+	{ counted_primitive,	"counted" },
+	{ counted_execute,	"counted_execute" },
+#endif
+};
+
+static struct word_entry *
+word_at(const void *address)
+{
+	struct word_entry *item;
+
+	LIST_FOREACH(item, &forth_dictionary, next)
+		if (item->code_address == address)
+			return item;
+
+	LIST_FOREACH(item, &macro_dictionary, next)
+		if (item->code_address == address)
+			return item;
+
+	return NULL;
+}
+
+static const char *
+address_name(const unsigned long address)
+{
+	static char name[32];
+	struct word_entry *word;
+
+	for (size_t i = 0; i < sizeof(runtime_names) / sizeof(runtime_names[0]); i++)
+		if ((unsigned long)runtime_names[i].address == address)
+			return runtime_names[i].name;
+
+	if ((word = word_at((void *)address)))
+		snprintf(name, sizeof(name), "%s", unpack(word->name));
+	else
+		snprintf(name, sizeof(name), "%#lx", address);
+
+	return name;
+}
+
+static void *
+definition_end(const struct word_entry *word, void *limit)
+{
+	struct word_entry *item;
+	void *end = limit;
+
+	LIST_FOREACH(item, &forth_dictionary, next)
+		if (item->code_address > word->code_address && item->code_address < end)
+			end = item->code_address;
+
+	LIST_FOREACH(item, &macro_dictionary, next)
+		if (item->code_address > word->code_address && item->code_address < end)
+			end = item->code_address;
+
+	return end;
+}
+
+// Conditional branches, followed by their target
+static bool
+is_branch(const unsigned long function)
+{
+	if (function == (unsigned long)zero_branch
+			|| function == (unsigned long)minus_branch
+			|| function == (unsigned long)next_aux)
+		return true;
+
+	for (size_t i = 0; i < NB_FUSED_BRANCHES; i++)
+		if (function == (unsigned long)fused_branches[i].branch)
+			return true;
+
+	return false;
+}
+
+static void
+decompile_threaded(const struct word_entry *word, FILE *out)
+{
+	unsigned long *start = word->code_address;
+	unsigned long *end   = definition_end(word, h);
+	unsigned long *cell  = start;
+
+	while (cell < end)
+	{
+		unsigned long function = *cell++;
+
+		fprintf(out, "%6ld  %s", cell - 1 - start, address_name(function));
+
+		if (function == (unsigned long)literal && cell < end)
+		{
+			fprintf(out, " %ld", (long)*cell++ >> 5);
+		}
+		else if (function == (unsigned long)variable && cell < end)
+		{
+			fprintf(out, ", value %ld", (long)*cell++);
+		}
+		else if ((function == (unsigned long)call_aux
+				|| function == (unsigned long)jump_aux) && cell < end)
+		{
+			unsigned long *target = (unsigned long *)*cell++;
+
+			if (target >= start && target < end)
+				fprintf(out, " -> %ld", target - start);
+			else
+				fprintf(out, " %s", address_name((unsigned long)target));
+		}
+		else if (is_branch(function) && cell < end)
+		{
+			fprintf(out, " -> %ld", (unsigned long *)*cell++ - start);
+		}
+#ifdef PROFILE_WORDS
+		else if ((function == (unsigned long)counted_call_aux
+				|| function == (unsigned long)counted_primitive) && cell < end)
+		{
+			fprintf(out, " %s", unpack(((struct word_entry *)*cell++)->name));
+		}
+#endif
+
+		fprintf(out, "\n");
+	}
+}
+
+static bool
+matches(const unsigned char *code, const unsigned char *end,
+		const unsigned char *pattern, const size_t length)
+{
+	return code + length <= end && !memcmp(code, pattern, length);
+}
+
+static unsigned long
+imm64_at(const unsigned char *code)
+{
+	unsigned long value;
+
+	memcpy(&value, code, sizeof(value));
+	return value;
+}
 
-	_ne->name		= pack("ne");
-	_ne->code_address	= ne;
-	_ne->codeword		= &(_ne->code_address);
+static void
+decompile_native(const struct word_entry *word, FILE *out)
+{
+	const unsigned char *start = word->code_address;
+	const unsigned char *end   = definition_end(word, native_here);
+	const unsigned char *code  = start;
 
-	_swap->name		= pack("swap");
-	_swap->code_address	= swap;
-	_swap->codeword		= &(_swap->code_address);
+	// The next definition is preceded by the frame drop of a fall through
+	if (end != native_here)
+		end -= NATIVE_FALL_THROUGH_SIZE;
 
-	_if->name		= pack("if");
-	_if->code_address	= if_;
-	_if->codeword		= &(_if->code_address);
+	while (code < end)
+	{
+		fprintf(out, "%6ld  ", code - start);
 
-	_then->name		= pack("then");
-	_then->code_address	= then;
-	_then->codeword		= &(_then->code_address);
+		if (matches(code, end, (const unsigned char []){0x48, 0x83, 0xec, 0x08}, 4))
+		{
+			fprintf(out, "enter");
+			code += 4;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xb8}, 2)
+				&& code + NATIVE_CHECK_SIZE <= end
+				&& imm64_at(code + 2) == (unsigned long)&native_stack_limit)
+		{
+			fprintf(out, "check depth");
+			code += NATIVE_CHECK_SIZE;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xb8}, 2)
+				&& code + NATIVE_CHECK_SIZE <= end
+				&& imm64_at(code + 2) == (unsigned long)&fuel)
+		{
+			fprintf(out, "burn fuel");
+			code += NATIVE_CHECK_SIZE;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0x83, 0xc4, 0x08, 0xc3}, 5))
+		{
+			fprintf(out, ";");
+			code += 5;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xb8}, 2)
+				&& matches(code + 10, end, (const unsigned char []){0xff, 0xd0}, 2))
+		{
+			fprintf(out, "call %s", address_name(imm64_at(code + 2)));
+			code += NATIVE_CALL_SIZE;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xb8}, 2)
+				&& matches(code + 10, end, (const unsigned char []){0x48, 0x83, 0xc4, 0x08, 0xff, 0xe0}, 6))
+		{
+			fprintf(out, "jump %s", address_name(imm64_at(code + 2)));
+			code += 16;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xba}, 2)
+				&& imm64_at(code + 2) == (unsigned long)&tos && code + 33 <= end)
+		{
+			fprintf(out, "literal %ld", (long)imm64_at(code + 22));
+			code += 33;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xba}, 2)
+				&& imm64_at(code + 2) == (unsigned long)&W && code + 23 <= end)
+		{
+			fprintf(out, "W = %s", unpack(((struct word_entry *)imm64_at(code + 12))->name));
+			code += 23;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0xbf}, 2) && code + 10 <= end)
+		{
+			fprintf(out, "rdi = %s", unpack(((struct word_entry *)imm64_at(code + 2))->name));
+			code += 10;
+		}
+		else if (matches(code, end, (const unsigned char []){0x48, 0x85, 0xc0, 0x0f, 0x85}, 5)
+				&& code + 9 <= end)
+		{
+			int32_t offset;
 
-	_for->name		= pack("for");
-	_for->code_address	= for_;
-	_for->codeword		= &(_for->code_address);
+			memcpy(&offset, code + 5, 4);
+			fprintf(out, "jnz -> %ld", code + 9 + offset - start);
+			code += 9;
+		}
+		else if (matches(code, end, (const unsigned char []){0xe9}, 1) && code + 5 <= end)
+		{
+			int32_t offset;
 
-	_next->name		= pack("next");
-	_next->code_address	= next_;
-	_next->codeword		= &(_next->code_address);
+			memcpy(&offset, code + 1, 4);
+			fprintf(out, "jmp -> %ld", code + 5 + offset - start);
+			code += 5;
+		}
+		else
+		{
+			fprintf(out, "db %#04x", *code++);
+		}
 
-	LIST_INSERT_HEAD(&macro_dictionary, _rdrop,	next);
-	LIST_INSERT_HEAD(&macro_dictionary, _ne,	next);
-	LIST_INSERT_HEAD(&macro_dictionary, _swap,	next);
-	LIST_INSERT_HEAD(&macro_dictionary, _if,	next);
-	LIST_INSERT_HEAD(&macro_dictionary, _then,	next);
-	LIST_INSERT_HEAD(&macro_dictionary, _for,	next);
-	LIST_INSERT_HEAD(&macro_dictionary, _next,	next);
+		fprintf(out, "\n");
+	}
 }
 
 void
-literal(void)
+decompile(const struct word_entry *word, FILE *out)
 {
-	// Skip literal's address
-	IP++;
-
-	// Fetch the number from the next cell
-	long n = *(long *)IP;
-	n >>= 5;  // Make it a number again ;-)
+	const unsigned char *address = word->code_address;
 
-	// Push the number on the stack
-	stack_push(n);
+	fprintf(out, "%s:\n", unpack(word->name));
 
-	NEXT();
+	if (is_definition(word))
+		decompile_threaded(word, out);
+	else if (native_heap && address >= native_heap && address < native_here)
+		decompile_native(word, out);
+	else
+		fprintf(out, "%6s  primitive at %p\n", "", word->code_address);
 }
 
-void
-variable(void)
+static void
+see_next_word(const cell_t word)
 {
-	IP++; // Fetch the variable's address from the next cell
-	stack_push((long)IP); // Push it on the stack
+	struct word_entry *entry = lookup_word(word, FORTH_DICTIONARY);
+
+	if (!entry)
+		entry = lookup_word(word, MACRO_DICTIONARY);
+
+	if (entry)
+		decompile(entry, stdout);
 }
 
 static void
-execute(const struct word_entry *word)
+see(void)
 {
-	printf("EXEC: %lx -> %lx\n", (unsigned long)word->code_address, *(unsigned long *)word->code_address);
-	IP = word->code_address;
-	((FUNCTION_EXEC)*(unsigned long *)word->codeword)();
+	next_word_consumer = see_next_word;
 }
 
 /*
- * Colorful words handling
+ * Cross references, from the blocks on disk: where prints the cells
+ * defining the next word, uses those running or compiling it.
  */
 static void
-ignore(const cell_t word)
+print_locations(const cell_t word, const bool is_definition)
 {
-	(void)word; // Avoid an useless warning and do nothing!
+	static const char *roles[16] = {[1] = "execute", [3] = "define",
+		[4] = "compile", [7] = "macro", [0xc] = "variable"};
+	unsigned int nb_locations;
+	struct xref_location *locations = xref_find(word, &nb_locations);
+
+	for (unsigned int i = 0; i < nb_locations; i++)
+	{
+		bool is_defining = locations[i].tag == 3 || locations[i].tag == 0xc;
+
+		if (is_defining == is_definition)
+			printf("%-8s block %d cell %u\n", roles[locations[i].tag],
+					locations[i].block, locations[i].cell);
+	}
+
+	free(locations);
 }
 
 static void
-interpret_forth_word(const cell_t word)
+where_next_word(const cell_t word)
 {
-	struct word_entry *entry = lookup_word(word, FORTH_DICTIONARY);
+	print_locations(word, true);
+}
 
-	if (entry)
-		execute(entry);
+static void
+uses_next_word(const cell_t word)
+{
+	print_locations(word, false);
 }
 
 static void
-interpret_big_number(const cell_t number)
+where(void)
 {
-	(void)number;
+	next_word_consumer = where_next_word;
 }
 
 static void
-interpret_number(const cell_t number)
+uses(void)
 {
-	stack_push(number >> 5);
+	next_word_consumer = uses_next_word;
 }
 
 static void
-compile_word(const cell_t word)
+task_next_word(const cell_t word)
 {
-	struct word_entry *entry = lookup_word(word, MACRO_DICTIONARY);
+	struct word_entry *entry = lookup_word(word, FORTH_DICTIONARY);
+	struct task *task;
+	int n;
 
-	if (entry)
+	if (!entry || !is_definition(entry))
 	{
-		// Execute macro word
-		printf("Execute Macro: name = %s, code_address = %p\n",
-				unpack(entry->name), entry->code_address);
-		execute(entry);
+		fprintf(stderr, "Error: a task runs a threaded definition!\n");
+		return;
 	}
-	else
+
+	for (n = 1; n < MAX_TASKS && tasks[n].is_used; n++)
+		;
+
+	if (n == MAX_TASKS)
 	{
-		entry = lookup_word(word, FORTH_DICTIONARY);
+		fprintf(stderr, "Error: too many tasks!\n");
+		return;
+	}
 
-		if (entry)
-		{
-			// Compile a call to that word
-			stack_push((long)entry->code_address);
-			comma();
-			printf("To compile: %s, %x, at address: %p\n", unpack(entry->name),
-					(int)entry->name, h);
-		}
+	task = &tasks[n];
+
+	// Stacks are kept for the next task using the slot
+	if (!task->data_area.mapping
+			&& (!guarded_stack_allocate(&task->data_area)
+				|| !guarded_stack_allocate(&task->return_area)))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
 	}
+
+	task->stack  = stack_base(&task->data_area);
+	task->tos    = start_of(task->stack);
+	task->rstack = stack_base(&task->return_area);
+	task->rtos   = start_of(task->rstack);
+
+#ifdef PROFILE_WORDS
+	task->boot[0] = (unsigned long)counted_call_aux;
+	task->boot[1] = (unsigned long)entry;
+#else
+	task->boot[0] = (unsigned long)call_aux;
+	task->boot[1] = (unsigned long)entry->code_address;
+#endif
+	task->boot[2] = (unsigned long)task_end;
+	task->IP      = task->boot;
+	task->is_used = true;
+
+	// It runs after the current task
+	task->next = tasks[current_task].next;
+	tasks[current_task].next = n;
 }
 
 static void
-compile_number(const cell_t number)
+task_word(void)
 {
-	stack_push((long)literal);
-	comma();
+	next_word_consumer = task_next_word;
+}
 
-	stack_push(number);
-	comma();
+/*
+ * Sampling profiler
+ *
+ * SIGPROF records the cell being executed and the return addresses on
+ * the return stack. Samples are kept raw and mapped back to definitions
+ * when the profiler stops: definitions never move and the code heap only
+ * grows, so the definition holding an address is the one starting
+ * closest below it. Native code has no IP to sample.
+ */
+#define PROFILE_BUFFER_SIZE (1024 * 1024)	// Cells for all samples
+#define PROFILE_MAX_DEPTH   64
+
+static unsigned long *profile_buffer;
+static volatile size_t profile_used;
+static volatile unsigned long profile_samples, profile_dropped;
+static unsigned int profile_frequency;
+
+static bool
+is_in_code_heap(const unsigned long address)
+{
+	return address >= (unsigned long)code_here
+		&& address < (unsigned long)h;
 }
 
 static void
-compile_big_number(const cell_t number)
+profile_handler(int signum)
 {
-	(void)number;
+	unsigned long frames[PROFILE_MAX_DEPTH];
+	size_t depth = 0;
+	(void)signum;
+
+	// Leaf first: the cell being executed, then each return address
+	if (IP && is_in_code_heap((unsigned long)(IP - 1)))
+		frames[depth++] = (unsigned long)(IP - 1);
+
+	for (unsigned long *r = rtos; r > start_of(rstack)
+			&& depth < PROFILE_MAX_DEPTH; r--)
+	{
+		// Skips loop counters and the null IP of outermost calls
+		if (is_in_code_heap(*r))
+			frames[depth++] = *r - sizeof(long);
+	}
+
+	if (profile_used + depth + 1 > PROFILE_BUFFER_SIZE)
+	{
+		profile_dropped++;
+		return;
+	}
+
+	profile_buffer[profile_used] = depth;
+	memcpy(&profile_buffer[profile_used + 1], frames, depth * sizeof(long));
+	profile_used += depth + 1;
+	profile_samples++;
 }
 
-static void
-compile_macro(const cell_t word)
+int
+profiler_start(const unsigned int frequency)
 {
-	struct word_entry *entry = lookup_word(word, MACRO_DICTIONARY);
+	struct sigaction action;
+	struct itimerval timer;
 
-	if (entry)
+	if (!profile_buffer)
+		profile_buffer = malloc(PROFILE_BUFFER_SIZE * sizeof(long));
+
+	if (!profile_buffer || frequency == 0)
+		return -1;
+
+	profile_used      = 0;
+	profile_samples   = 0;
+	profile_dropped   = 0;
+	profile_frequency = frequency;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profile_handler;
+	action.sa_flags   = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+
+	timer.it_interval.tv_sec  = 0;
+	timer.it_interval.tv_usec = 1000000 / frequency;
+	timer.it_value            = timer.it_interval;
+
+	return setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+struct profile_entry
+{
+	const struct word_entry *word;
+	unsigned long            self;
+	unsigned long            total;
+	unsigned long            last_sample; // Counts a word once per sample
+};
+
+static int
+compare_code_address(const void *a, const void *b)
+{
+	const struct profile_entry *x = a, *y = b;
+
+	if (x->word->code_address == y->word->code_address)
+		return 0;
+
+	return x->word->code_address < y->word->code_address ? -1 : 1;
+}
+
+static int
+compare_self(const void *a, const void *b)
+{
+	const struct profile_entry *x = a, *y = b;
+
+	if (x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+
+	return x->total < y->total ? 1 : (x->total > y->total ? -1 : 0);
+}
+
+static int
+compare_string(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static struct profile_entry *
+profile_lookup(struct profile_entry *entries, size_t nb_entries,
+		const unsigned long address)
+{
+	size_t low = 0, high = nb_entries;
+
+	// Last definition starting at or before the address
+	while (low < high)
 	{
-		// Compile a call to that macro
-		printf("Macro: %s -> %lx\n", unpack(word), (unsigned long)entry->code_address);
-		stack_push((long)entry->code_address);
-		comma();
+		size_t middle = (low + high) / 2;
+
+		if ((unsigned long)entries[middle].word->code_address <= address)
+			low = middle + 1;
+		else
+			high = middle;
 	}
+
+	return low ? &entries[low - 1] : NULL;
 }
 
 static void
-create_word(cell_t word)
+profile_write_folded(FILE *folded, struct profile_entry *entries,
+		size_t nb_entries)
 {
-	struct word_entry *entry = calloc(1, sizeof(struct word_entry));
+	char **stacks = calloc(profile_samples, sizeof(char *));
+	size_t nb_stacks = 0;
 
-	if (!entry)
+	if (!stacks)
+		return;
+
+	for (size_t i = 0; i < profile_used; i += profile_buffer[i] + 1)
 	{
-		fprintf(stderr, "Error: Not enough memory!\n");
-		colorforth_finalize();
-		exit(EXIT_FAILURE);
+		size_t depth = profile_buffer[i];
+		char line[PROFILE_MAX_DEPTH * 16];
+		int pos = 0;
+
+		// Folded stacks go from the root to the leaf
+		for (size_t f = depth; f > 0 && pos < (int)sizeof(line); f--)
+		{
+			struct profile_entry *entry = profile_lookup(entries,
+					nb_entries, profile_buffer[i + f]);
+
+			pos += snprintf(&line[pos], sizeof(line) - pos, "%s%s",
+					pos ? ";" : "",
+					entry ? unpack(entry->word->name) : "?");
+		}
+
+		if ((stacks[nb_stacks] = strdup(depth ? line : "(interpreter)")))
+			nb_stacks++;
 	}
 
-	word &= 0xfffffff0;
+	qsort(stacks, nb_stacks, sizeof(char *), compare_string);
 
-	entry->name         = word;
-	entry->code_address = h;
-	entry->codeword     = h;
+	for (size_t i = 0, j; i < nb_stacks; i = j)
+	{
+		for (j = i + 1; j < nb_stacks && !strcmp(stacks[i], stacks[j]); j++)
+			;
 
-	printf("create_word(): at %p, name = %x\n", entry->code_address,
-			(int)entry->name);
+		fprintf(folded, "%s %zu\n", stacks[i], j - i);
+	}
 
-	if (selected_dictionary == MACRO_DICTIONARY)
-		LIST_INSERT_HEAD(&macro_dictionary, entry, next);
-	else
-		LIST_INSERT_HEAD(&forth_dictionary, entry, next);
+	for (size_t i = 0; i < nb_stacks; i++)
+		free(stacks[i]);
+
+	free(stacks);
 }
 
-static void
-variable_word(const cell_t word)
+void
+profiler_stop(FILE *report, FILE *folded)
 {
-	// A variable must be defined in forth dictionary
-	forth();
+	struct itimerval timer;
+	struct word_entry *item;
+	struct profile_entry *entries;
+	size_t nb_entries = 0;
+	unsigned long sample = 0;
 
-	create_word(word);
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	signal(SIGPROF, SIG_IGN);
 
-	// Variable's handler
-	stack_push((long)variable);
-	comma();
+	LIST_FOREACH(item, &forth_dictionary, next)
+		nb_entries++;
+	LIST_FOREACH(item, &macro_dictionary, next)
+		nb_entries++;
 
-	// The default value of a variable is 0 (green number)
-	stack_push(0);
-	comma();
+	entries = calloc(nb_entries + 1, sizeof(struct profile_entry));
+
+	if (!entries)
+		return;
+
+	nb_entries = 0;
+
+	LIST_FOREACH(item, &forth_dictionary, next)
+		if (is_definition(item))
+			entries[nb_entries++].word = item;
+	LIST_FOREACH(item, &macro_dictionary, next)
+		if (is_definition(item))
+			entries[nb_entries++].word = item;
+
+	qsort(entries, nb_entries, sizeof(*entries), compare_code_address);
+
+	for (size_t i = 0; i < profile_used; i += profile_buffer[i] + 1)
+	{
+		size_t depth = profile_buffer[i];
+
+		sample++;
+
+		for (size_t f = 1; f <= depth; f++)
+		{
+			struct profile_entry *entry = profile_lookup(entries,
+					nb_entries, profile_buffer[i + f]);
+
+			if (!entry)
+				continue;
+
+			if (f == 1)
+				entry->self++;
+
+			if (entry->last_sample != sample)
+			{
+				entry->total++;
+				entry->last_sample = sample;
+			}
+		}
+	}
+
+	if (folded)
+		profile_write_folded(folded, entries, nb_entries);
+
+	if (report)
+	{
+		double period = 1.0 / profile_frequency;
+
+		qsort(entries, nb_entries, sizeof(*entries), compare_self);
+
+		fprintf(report, "%lu samples (%lu dropped), %.3f s\n",
+				profile_samples, profile_dropped,
+				profile_samples * period);
+		fprintf(report, "%10s %10s  %s\n", "self (s)", "total (s)", "word");
+
+		for (size_t i = 0; i < nb_entries && entries[i].total; i++)
+			fprintf(report, "%10.3f %10.3f  %s\n",
+					entries[i].self * period,
+					entries[i].total * period,
+					unpack(entries[i].word->name));
+	}
+
+	free(entries);
 }
 
 /*
  * Initializing and deinitalizing colorForth
  */
+static void *
+guarded_stack_allocate(struct guarded_stack *area)
+{
+	size_t page   = sysconf(_SC_PAGESIZE);
+	size_t usable = (STACK_SIZE * sizeof(long) + page - 1) / page * page;
+
+	area->length  = page + usable + page;
+	area->mapping = mmap(NULL, area->length, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (area->mapping == MAP_FAILED)
+		return NULL;
+
+	area->low_guard_end = (char *)area->mapping + page;
+	area->high_guard    = area->low_guard_end + usable;
+
+	if (mprotect(area->low_guard_end, usable, PROT_READ | PROT_WRITE) == -1)
+		return NULL;
+
+	return stack_base(area);
+}
+
 void
 colorforth_initialize(void)
 {
+	struct sigaction action;
+	struct word_entry *item;
+
 	code_here = malloc(CODE_HEAP_SIZE);
+	stack     = guarded_stack_allocate(&data_stack_area);
+	rstack    = guarded_stack_allocate(&return_stack_area);
 
-	if (!code_here)
+	if (!code_here || !stack || !rstack)
 	{
 		fprintf(stderr, "Error: Not enough memory!\n");
 		exit(EXIT_FAILURE);
 	}
 
+	stack_reset();
+
+	tasks[0].data_area   = data_stack_area;
+	tasks[0].return_area = return_stack_area;
+	tasks[0].next        = 0;
+	tasks[0].is_used     = true;
+	current_task         = 0;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = stack_fault_handler;
+	action.sa_flags     = SA_SIGINFO;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, NULL);
+
 	h = code_here;
 
 	LIST_INIT(&forth_dictionary);
@@ -945,6 +3626,13 @@ colorforth_initialize(void)
 	insert_builtins_into_forth_dictionary();
 	insert_builtins_into_macro_dictionary();
 	dump_dict();
+
+	// Completed at the prompt
+	LIST_FOREACH(item, &forth_dictionary, next)
+		name_add(item->name);
+
+	LIST_FOREACH(item, &macro_dictionary, next)
+		name_add(item->name);
 }
 
 void
@@ -952,6 +3640,10 @@ colorforth_finalize(void)
 {
 	struct word_entry *item;
 
+#ifdef PROFILE_WORDS
+	word_counters_report(stdout);
+#endif
+
 	while ((item = LIST_FIRST(&forth_dictionary)))
 	{
 		LIST_REMOVE(item, next);
@@ -964,5 +3656,44 @@ colorforth_finalize(void)
 		free(item);
 	}
 
+	names_clear();
+
+	for (cell_t n = 0; n < nb_block_resolutions; n++)
+		free(block_resolutions[n]);
+
+	free(block_resolutions);
+	block_resolutions    = NULL;
+	nb_block_resolutions = 0;
+	memset(prompt_resolutions, 0, sizeof(prompt_resolutions));
+
+	free(profile_buffer);
+	profile_buffer = NULL;
+
+	free(inline_sites);
+	inline_sites       = NULL;
+	current_definition = NULL;
+	nb_inline_sites = inline_sites_size = 0;
+
 	free(code_here);
+
+	if (native_heap)
+	{
+		munmap(native_heap, NATIVE_HEAP_SIZE);
+		munmap(native_alias, NATIVE_HEAP_SIZE);
+		native_heap  = native_alias = native_here = NULL;
+		compile_mode = THREADED_CODE;
+	}
+
+	for (int n = 1; n < MAX_TASKS; n++)
+	{
+		if (tasks[n].data_area.mapping)
+			munmap(tasks[n].data_area.mapping, tasks[n].data_area.length);
+		if (tasks[n].return_area.mapping)
+			munmap(tasks[n].return_area.mapping, tasks[n].return_area.length);
+	}
+
+	memset(tasks, 0, sizeof(tasks));
+
+	munmap(data_stack_area.mapping, data_stack_area.length);
+	munmap(return_stack_area.mapping, return_stack_area.length);
 }
@@ -1,44 +1,50 @@
 #include <stdbool.h>
+#include <limits.h>
 #include <unistd.h>
-#include <sys/fcntl.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
 
 #include "SDL.h"
 #include "SDL_ttf.h"
 
 #include "colorforth.h"
 
+#define SPACE_BETWEEN_WORDS	7
+#define FRAME_PERIOD		16	// ms, when the renderer can't wait for vsync
+#define BENCHMARK_BLOCKS	32
+#define BENCHMARK_FRAMES	1000	// Of each kind
+#define BENCHMARK_DUMPED	32	// First frames of each kind saved with -d
+
 SDL_Color red         = {.r=234, .g=8,   .b=8};
-SDL_Color cyan        = {.r=0,   .g=216, .b=249};
-SDL_Color green       = {.r=9,   .g=201, .b=16};
-SDL_Color dark_green  = {.r=36,  .g=122, .b=39};
 SDL_Color yellow      = {.r=255, .g=255, .b=0};
-SDL_Color dark_yellow = {.r=212, .g=209, .b=66};
-SDL_Color magenta     = {.r=210, .g=20,  .b=197};
 SDL_Color white       = {.r=255, .g=255, .b=255};
-SDL_Color black       = {.r=0,   .g=0,   .b=0};
 
 SDL_Renderer *renderer;
 TTF_Font     *font;
-SDL_Surface  *surface;
-SDL_Texture  *texture;
 
-cell_t      *blocks;
 bool         is_first_definition;
-bool         is_command = false;
-bool         is_dirty_hack = false;
 unsigned int word_index;
-int          nb_block = 0;
+
+/*
+ * The whole screen is drawn again from the state of the front end, at
+ * most once per frame and only when something changed or the frame times
+ * are shown.
+ */
+bool         done;
+
+// Frame times for the overlay
+uint64_t     last_present;
+double       frame_interval_ms;
+double       frame_build_ms;
+uint32_t     input_ticks;		// When the oldest input of the frame came
+uint32_t     input_latency_ms;	// From that input to the frame on screen
 
 // Globally defined for display_word() and screen_clear()
 int x = 0, y = 0;
 
-#define MASK 			0xffffffffL
-#define INTERPRET_NUMBER_TAG 	8
-#define INTERPRET_WORD_TAG 	0x00000001
-#define SPACE_BETWEEN_WORDS	7
-#define WORD_MAX_LENGTH 	20
+static SDL_Color
+sdl_color(const struct rgb color)
+{
+	return (SDL_Color){.r = color.r, .g = color.g, .b = color.b};
+}
 
 static void
 cursor_display(int x, int y)
@@ -46,15 +52,20 @@ cursor_display(int x, int y)
 	SDL_Rect r = {.x = x, .y = y, .w = 10, .h = 12};
 	SDL_SetRenderDrawColor(renderer, 0, 12, 125, 255);
 	SDL_RenderFillRect(renderer, &r);
-	SDL_RenderPresent(renderer);
 }
 
 static void
-display_text(char *text, SDL_Color color, int x, int y)
+display_text(const char *text, SDL_Color color, int x, int y)
 {
+	SDL_Surface *surface;
+	SDL_Texture *texture;
 	int texW = 0;
 	int texH = 0;
 
+	// SDL_ttf refuses to render an empty text
+	if (!*text)
+		return;
+
 	surface = TTF_RenderText_Solid(font, text, color);
 	texture = SDL_CreateTextureFromSurface(renderer, surface);
 
@@ -62,94 +73,43 @@ display_text(char *text, SDL_Color color, int x, int y)
 	SDL_Rect location = {x, y, texW, texH};
 
 	SDL_RenderCopy(renderer, texture, NULL, &location);
-	SDL_RenderPresent(renderer);
+	SDL_DestroyTexture(texture);
+	SDL_FreeSurface(surface);
 }
 
 static void
 display_word(cell_t word)
 {
 	uint8_t word_color = word & 0x0000000f;
-	//bool is_hex = false;
 	static SDL_Color color;
 	char unpacked[WORD_MAX_LENGTH]; // Let's forsee very large
 	int w, h; // text width and height
 
-	switch(word_color)
+	if (word_color == 0xd || word_color == 0xe)
 	{
-		case 0:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%s", unpack(word));
-			TTF_SizeText(font, unpacked, &w, &h);
-			x -= w; // Go back to hide a space
-			break;
-
-		case 1:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%s", unpack(word));
-			color = yellow;
-			break;
-
-		case 2:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%d", word >> 5);
-			color = dark_yellow;
-			break;
-
-		case 3:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%s", unpack(word));
-			TTF_SizeText(font, unpacked, &w, &h);
-			if (is_first_definition)
-				is_first_definition = false;
-			else
-				y += h;
-			x = 0;
-			color = red;
-			break;
-
-		case 4:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%s", unpack(word));
-			color = green;
-			break;
-
-		case 5:
-			/*if (word & 0x10)
-				is_hex = true;*/
-			snprintf(unpacked, WORD_MAX_LENGTH, "%d", word >> 5);
-			color = dark_green;
-			break;
-
-		case 6:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%d", word >> 5);
-			color = green;
-			break;
-
-		case 7:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%d", word >> 5);
-			color = cyan;
-			break;
-
-		case 8:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%d", word >> 5);
-			color = yellow;
-			break;
-
-		case 9:
-		case 0xa:
-		case 0xb:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%s", unpack(word));
-			color = white;
-			break;
+		SDL_Log("Error: wrong color code!");
+		return;
+	}
 
-		case 0xc:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%s", unpack(word));
-			color = magenta;
-			break;
+	word_text(word, unpacked, WORD_MAX_LENGTH);
 
-		case 0xf:
-			snprintf(unpacked, WORD_MAX_LENGTH, "%d", word >> 5);
-			color = white;
-			break;
+	// Extension cells keep the color of their word
+	if (word_color)
+		color = sdl_color(palette[word_color]);
 
-		default:
-			SDL_Log("Error: wrong color code!");
-			break;
+	if (word_color == 0)
+	{
+		TTF_SizeText(font, unpacked, &w, &h);
+		x -= w; // Go back to hide a space
+	}
+	else if (word_color == 3)
+	{
+		TTF_SizeText(font, unpacked, &w, &h);
+		if (is_first_definition)
+			is_first_definition = false;
+		else
+			y += h;
+		x = 0;
 	}
 
 	display_text(unpacked, color, x, y);
@@ -188,83 +148,301 @@ status_bar_update_block_number(cell_t n)
 static void
 display_stack()
 {
-	char *stack_content = dot_s();
-	display_text(stack_content, yellow, 0, 570);
-	free(stack_content);
+	display_text(front_end.stack ? front_end.stack : "", yellow, 0, 570);
+
+	if (worker_is_busy())
+		display_text("Running, Escape interrupts", yellow, 400, 560);
 }
 
 static void
 display_block(cell_t n)
 {
-	unsigned long start = n * 256;     // Start executing block from here...
-	unsigned long limit = (n+1) * 256; // to this point.
+	cell_t cells[BLOCK_CELLS];
+	int cursor;
+	unsigned int nb_cells = displayed_cells(cells, &cursor);
 
 	screen_clear();
 
 	is_first_definition = true;
 
-	for (word_index = start; word_index < limit; word_index++)
-		display_word(blocks[word_index]);
+	for (word_index = 0; word_index < nb_cells; word_index++)
+	{
+		if ((int)word_index == cursor)
+			cursor_display(x, y + 10);
+
+		display_word(cells[word_index]);
+	}
+
+	if ((int)nb_cells == cursor)
+		cursor_display(x, y + 10);
 
 	command_prompt_display();
 	status_bar_update_block_number(n);
 	display_stack();
 }
 
-bool
-is_number(const char *ptr)
+static double
+elapsed_ms(const uint64_t start, const uint64_t end)
+{
+	return (end - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static void
+display_overlay(void)
+{
+	char times[64];
+
+	snprintf(times, sizeof(times), "frame %.1f ms build %.1f ms input %u ms",
+			frame_interval_ms, frame_build_ms, input_latency_ms);
+	display_text(times, white, 380, 0);
+}
+
+/*
+ * Build the frame and present it, presenting waits for vsync so there is
+ * at most one frame per refresh.
+ */
+static void
+present_frame(const bool has_vsync)
 {
-	while (*ptr++)
+	uint64_t start = SDL_GetPerformanceCounter();
+	uint64_t end;
+
+	display_block(front_end.block);
+	display_text(front_end.word, sdl_color(front_end.color), 10, 550);
+
+	if (front_end.message)
+		display_text(front_end.message, red, 0, 585);
+	else
+		display_text(front_end.candidates, white, 0, 585);
+
+	if (front_end.is_overlay_shown)
+		display_overlay();
+
+	frame_build_ms = elapsed_ms(start, SDL_GetPerformanceCounter());
+
+	if (!has_vsync && frame_build_ms < FRAME_PERIOD)
+		SDL_Delay(FRAME_PERIOD - frame_build_ms);
+
+	SDL_RenderPresent(renderer);
+
+	end = SDL_GetPerformanceCounter();
+	frame_interval_ms = elapsed_ms(last_present, end);
+	last_present = end;
+
+	if (input_ticks)
 	{
-		// Allowed ones are 0 to 9 and NULL
-		if (!((*ptr >= 0x31 && *ptr <= 0x39) || *ptr == 0x00))
-			return false;
+		input_latency_ms = SDL_GetTicks() - input_ticks;
+		input_ticks = 0;
+	}
+
+	front_end.is_redraw_needed = false;
+}
+
+// Runs on the interpreter thread, the snapshot is read by the event loop
+static void
+snapshot_published(void)
+{
+	SDL_Event event = {.type = SDL_USEREVENT};
+
+	SDL_PushEvent(&event);
+}
+
+// SDL keys for the shared key commands
+static const struct
+{
+	SDL_Keycode         sdl;
+	enum front_end_key key;
+} keys[] = {
+	{ SDLK_F1, KEY_F1 },		{ SDLK_F2, KEY_F2 },
+	{ SDLK_F3, KEY_F3 },		{ SDLK_F4, KEY_F4 },
+	{ SDLK_F5, KEY_F5 },		{ SDLK_F6, KEY_F6 },
+	{ SDLK_F7, KEY_F7 },		{ SDLK_F8, KEY_F8 },
+	{ SDLK_F9, KEY_F9 },		{ SDLK_F10, KEY_F10 },
+	{ SDLK_F11, KEY_F11 },		{ SDLK_F12, KEY_F12 },
+	{ SDLK_PAGEUP, KEY_PAGE_UP },	{ SDLK_PAGEDOWN, KEY_PAGE_DOWN },
+	{ SDLK_LEFT, KEY_LEFT },	{ SDLK_RIGHT, KEY_RIGHT },
+	{ SDLK_UP, KEY_UP },		{ SDLK_DOWN, KEY_DOWN },
+	{ SDLK_HOME, KEY_HOME },	{ SDLK_END, KEY_END },
+	{ SDLK_DELETE, KEY_DELETE },	{ SDLK_BACKSPACE, KEY_BACKSPACE },
+	{ SDLK_SPACE, KEY_SPACE },	{ SDLK_ESCAPE, KEY_ESCAPE },
+	{ SDLK_RETURN, KEY_RETURN },	{ SDLK_TAB, KEY_TAB },
+};
+
+static void
+handle_key(const SDL_Keycode key)
+{
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	{
+		if (keys[i].sdl == key)
+		{
+			front_end_key(keys[i].key);
+			return;
+		}
+	}
+}
+
+static void
+handle_event(const SDL_Event *event)
+{
+	switch (event->type)
+	{
+		case SDL_QUIT:
+			done = true;
+			break;
+
+		case SDL_WINDOWEVENT:
+			front_end.is_redraw_needed = true;
+			break;
+
+		case SDL_USEREVENT:
+			front_end_snapshot();
+			break;
+
+		case SDL_KEYDOWN:
+			if (!input_ticks)
+				input_ticks = event->key.timestamp;
+
+			handle_key(event->key.keysym.sym);
+			front_end.is_redraw_needed = true;
+			break;
+
+		case SDL_TEXTINPUT:
+			if (!input_ticks)
+				input_ticks = event->text.timestamp;
+
+			front_end_text(event->text.text);
+			break;
 	}
+}
+
+/*
+ * Benchmark of the draw path, without a display: SDL's dummy video
+ * driver and a software renderer drawing into a surface, over synthetic
+ * blocks full of words of every color.
+ */
+static unsigned int
+benchmark_word(const char *text, const cell_t tag, cell_t *cells)
+{
+	int nb_cells = pack_word(text, cells, 4);
+
+	cells[0] |= tag;
 
-	return true;
+	return nb_cells;
 }
 
 static int
-do_cmd(const char *word)
+benchmark_blocks(const char *path)
 {
-	cell_t packed;
+	static const char *words[] = {"dup", "drop", "swap", "over", "or",
+		"and", "negate", "if", "then", "begin", "until", "block",
+		"display", "colorforth", "cursor", "key", "words", "fetch"};
+	const unsigned int nb_words = sizeof(words) / sizeof(words[0]);
+	cell_t *cells = calloc(BENCHMARK_BLOCKS * BLOCK_CELLS, sizeof(cell_t));
+	unsigned int k = 0;
+	int status;
 
-	if (is_number(word))
+	if (!cells)
 	{
-		packed = ((atoi(word) << 5) & MASK) + INTERPRET_NUMBER_TAG;
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
 	}
-	else
+
+	for (cell_t n = 0; n < BENCHMARK_BLOCKS; n++)
 	{
-		packed = (pack(word) & 0xfffffff0) | INTERPRET_WORD_TAG;
+		cell_t *block = &cells[n * BLOCK_CELLS];
+		unsigned int i = 0;
+
+		// A screen of definitions, each on its line
+		for (int line = 0; line < 18 && i + 24 < BLOCK_CELLS; line++)
+		{
+			i += benchmark_word(words[k++ % nb_words], 3, &block[i]);
+
+			for (int j = 0; j < 7; j++)
+				i += benchmark_word(words[k++ % nb_words], j == 6 ? 1 : 4,
+						&block[i]);
 
-		if (!lookup_word(packed, FORTH_DICTIONARY))
-			return -1;
+			block[i++] = (cell_t)(k % 1000) << 5 | 6;
+			i += benchmark_word("comment", 9, &block[i]);
+		}
 	}
 
-	if ((cell_t)(packed & 0xfffffff0) == pack("dup"))
-		is_dirty_hack = true;
-	else
-		is_dirty_hack = false;
+	status = block_store_save(path, cells, BENCHMARK_BLOCKS, false);
+	free(cells);
 
-	do_word(packed);
+	return status;
+}
 
-	return 0;
+static void
+benchmark_redraw(const unsigned int i)
+{
+	(void)i;
 }
 
+// Down to the last block and back up
+static void
+benchmark_page_flip(const unsigned int i)
+{
+	front_end_key((i / (BENCHMARK_BLOCKS - 1)) % 2 ? KEY_PAGE_UP : KEY_PAGE_DOWN);
+}
 
-int
-main(void)
+// Type a word at the prompt and erase it
+static void
+benchmark_command_line(const unsigned int i)
 {
-	char word[WORD_MAX_LENGTH];
-	bool done = SDL_FALSE;
-	char *str;
-	int status;
-	int fd;
-	struct stat sbuf;
+	char letter[2] = {"benchmarking"[i % 12], '\0'};
 
+	if ((i / 12) % 2)
+		front_end_key(KEY_BACKSPACE);
+	else
+		front_end_text(letter);
+}
 
+static void
+benchmark_run(const char *name, void (*step)(const unsigned int),
+		SDL_Surface *surface, const char *frames)
+{
+	char path[PATH_MAX];
+	double total_ms = 0, max_ms = 0, ms;
+	uint64_t start;
 	SDL_Event event;
 
+	for (unsigned int i = 0; i < BENCHMARK_FRAMES; i++)
+	{
+		// Stacks published by the interpreter thread
+		while (SDL_PollEvent(&event))
+			handle_event(&event);
+
+		start = SDL_GetPerformanceCounter();
+		step(i);
+		present_frame(true);
+		ms = elapsed_ms(start, SDL_GetPerformanceCounter());
+
+		total_ms += ms;
+		if (ms > max_ms)
+			max_ms = ms;
+
+		if (frames && i < BENCHMARK_DUMPED)
+		{
+			snprintf(path, sizeof(path), "%s/%s-%02u.bmp", frames, name, i);
+			if (SDL_SaveBMP(surface, path) < 0)
+				SDL_Log("Unable to save %s: %s", path, SDL_GetError());
+		}
+	}
+
+	printf("%-14s %u frames %8.3f ms per frame %8.3f ms max %8.0f frames/s\n",
+			name, BENCHMARK_FRAMES, total_ms / BENCHMARK_FRAMES, max_ms,
+			BENCHMARK_FRAMES * 1000.0 / total_ms);
+}
+
+static int
+benchmark(const char *frames)
+{
+	char path[] = "/tmp/iridescence-benchmark-XXXXXX";
+	SDL_Surface *surface;
+	int fd;
+
+	SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 	{
 		SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
@@ -273,145 +451,132 @@ main(void)
 
 	TTF_Init();
 
-	SDL_Window *window = SDL_CreateWindow("Iridescence colorForth",
-		SDL_WINDOWPOS_UNDEFINED,
-		SDL_WINDOWPOS_UNDEFINED,
-		800, 600, 0);
-	renderer = SDL_CreateRenderer(window, -1, 0);
-	font = TTF_OpenFont("GohuFont-Bold.ttf", 25);
-	SDL_Color color = yellow;
-
-	memset(word, 0, WORD_MAX_LENGTH);
+	surface  = SDL_CreateRGBSurfaceWithFormat(0, 800, 600, 32,
+			SDL_PIXELFORMAT_ARGB8888);
+	renderer = surface ? SDL_CreateSoftwareRenderer(surface) : NULL;
+	font     = TTF_OpenFont("GohuFont-Bold.ttf", 25);
 
-	if ((fd = open("blocks/blocks.cf", O_RDONLY)) == -1)
+	if (!renderer || !font)
 	{
-		perror("open");
+		SDL_Log("Unable to draw offscreen: %s", SDL_GetError());
 		exit(EXIT_FAILURE);
 	}
 
-	if (stat("blocks/blocks.cf", &sbuf) == -1)
+	if ((fd = mkstemp(path)) == -1)
 	{
-		perror("stat");
+		perror(path);
 		exit(EXIT_FAILURE);
 	}
 
-	blocks = mmap(0, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
 
-	if (blocks == MAP_FAILED)
+	if (benchmark_blocks(path) == -1
+			|| front_end_start(path, snapshot_published) == -1)
 	{
-		perror("mmap");
+		unlink(path);
 		exit(EXIT_FAILURE);
 	}
 
-	colorforth_initialize();
-
-	display_block(0);
-
-	while (!done)
-	{
-		SDL_WaitEvent(&event);
-
-		switch (event.type)
-		{
-			case SDL_QUIT:
-				done = SDL_TRUE;
-				break;
+	last_present = SDL_GetPerformanceCounter();
 
-			case SDL_KEYDOWN:
-				switch (event.key.keysym.sym)
-				{
-					case SDLK_F1:
-						color = red;
-						break;
+	benchmark_run("redraw", benchmark_redraw, surface, frames);
+	benchmark_run("page-flip", benchmark_page_flip, surface, frames);
+	benchmark_run("command-line", benchmark_command_line, surface, frames);
 
-					case SDLK_F2:
-						color = cyan;
-						break;
+	front_end_stop();
+	unlink(path);
 
-					case SDLK_F3:
-						color = green;
-						break;
+	TTF_CloseFont(font);
+	SDL_DestroyRenderer(renderer);
+	SDL_FreeSurface(surface);
+	TTF_Quit();
+	SDL_Quit();
 
-					case SDLK_F4:
-						color = dark_green;
-						break;
+	return 0;
+}
 
-					case SDLK_F5:
-						color = yellow;
-						break;
+int
+main(int argc, char *argv[])
+{
+	SDL_Event event;
+	SDL_RendererInfo info;
+	bool has_vsync;
+	bool is_benchmark = false;
+	const char *frames = NULL;
+	int option;
 
-					case SDLK_F6:
-						color = dark_yellow;
-						break;
+	while ((option = getopt(argc, argv, "bd:")) != -1)
+	{
+		switch (option)
+		{
+			case 'b':
+				is_benchmark = true;
+				break;
 
-					case SDLK_F7:
-						color = magenta;
-						break;
+			case 'd':
+				frames = optarg;
+				break;
 
-					case SDLK_F8:
-						color = white;
-						break;
+			default:
+				fprintf(stderr, "Usage: %s [-b [-d frames]]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
 
-					case SDLK_F9:
-						x = 10;
-						y = 550;
-						is_command = true;
-						break;
+	if (is_benchmark)
+		return benchmark(frames);
 
-					case SDLK_F10:
-						x = 0;
-						y = 0;
-						break;
+	if (SDL_Init(SDL_INIT_VIDEO) < 0)
+	{
+		SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
+		exit(EXIT_FAILURE);
+	}
 
-					case SDLK_PAGEDOWN:
-						display_block(++nb_block);
-						break;
+	TTF_Init();
 
-					case SDLK_PAGEUP:
-						if (nb_block-1 < 0)
-							break;
-						display_block(--nb_block);
-						break;
+	SDL_Window *window = SDL_CreateWindow("Iridescence colorForth",
+		SDL_WINDOWPOS_UNDEFINED,
+		SDL_WINDOWPOS_UNDEFINED,
+		800, 600, 0);
+	renderer = SDL_CreateRenderer(window, -1,
+		SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 
-					case SDLK_SPACE:
-						str = rindex(word, ' ');
+	if (!renderer)
+		renderer = SDL_CreateRenderer(window, -1, 0);
 
-						// Get rid of a potential space
-						status = str ? do_cmd(str + 1) : do_cmd(word);
+	// Vsync may be asked for and not granted, frames are then paced by a
+	// delay instead
+	has_vsync = renderer && SDL_GetRendererInfo(renderer, &info) == 0
+		&& (info.flags & SDL_RENDERER_PRESENTVSYNC);
 
-						memset(word, 0, WORD_MAX_LENGTH);
-						display_block(nb_block);
+	font = TTF_OpenFont("GohuFont-Bold.ttf", 25);
 
-						if (status == -1)
-							display_text("Error: word not found!", red, 0, 585);
+	if (front_end_start("blocks/blocks.cf", snapshot_published) == -1)
+		exit(EXIT_FAILURE);
 
-						break;
+	last_present = SDL_GetPerformanceCounter();
 
-					case SDLK_UP:
-						cursor_display(x, y+10);
-						break;
-				}
-				break;
+	while (!done)
+	{
+		// Sleep until something happens, then take all that is pending
+		if (!front_end.is_redraw_needed && !front_end.is_overlay_shown
+				&& SDL_WaitEvent(&event))
+			handle_event(&event);
 
-			case SDL_TEXTINPUT:
-				strcat(word, event.text.text);
-				break;
-		}
+		while (SDL_PollEvent(&event))
+			handle_event(&event);
 
-		display_text(word, color, 10, 550);
+		if (!done && (front_end.is_redraw_needed || front_end.is_overlay_shown))
+			present_frame(has_vsync);
 	}
 
-	SDL_DestroyTexture(texture);
-	SDL_FreeSurface(surface);
 	TTF_CloseFont(font);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 	TTF_Quit();
 	SDL_Quit();
 
-	munmap(blocks, sbuf.st_size);
-	close(fd);
-	colorforth_finalize();
+	front_end_stop();
 
 	return 0;
 }
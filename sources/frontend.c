@@ -0,0 +1,741 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Shared by the front ends
+ *
+ * The SDL editor and the terminal only draw and turn their keys into
+ * these. Colors of the words, the block being edited and what the keys
+ * do are the same in both.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "colorforth.h"
+
+#define MASK                 0xffffffffL
+#define INTERPRET_NUMBER_TAG 8
+#define INTERPRET_WORD_TAG   0x00000001
+#define CANDIDATES_SHOWN     8
+
+#define RED         {234, 8,   8}
+#define CYAN        {0,   216, 249}
+#define GREEN       {9,   201, 16}
+#define DARK_GREEN  {36,  122, 39}
+#define YELLOW      {255, 255, 0}
+#define DARK_YELLOW {212, 209, 66}
+#define MAGENTA     {210, 20,  197}
+#define WHITE       {255, 255, 255}
+
+// By tag, extension cells take the color of their word
+const struct rgb palette[16] = {
+	[0x1] = YELLOW,		// Execute
+	[0x2] = DARK_YELLOW,	// Execute long number
+	[0x3] = RED,		// Define
+	[0x4] = GREEN,		// Compile
+	[0x5] = DARK_GREEN,	// Compile long number
+	[0x6] = GREEN,		// Compile number
+	[0x7] = CYAN,		// Compile macro
+	[0x8] = YELLOW,		// Execute number
+	[0x9] = WHITE,		// Comments
+	[0xa] = WHITE,
+	[0xb] = WHITE,
+	[0xc] = MAGENTA,	// Variable
+	[0xf] = WHITE,		// Commented number
+};
+
+// F1 to F8, the tag of the words typed and the color they are shown in
+static const struct
+{
+	cell_t     tag;
+	struct rgb color;
+} typed_colors[8] = {
+	{ 3,   RED },
+	{ 7,   CYAN },
+	{ 4,   GREEN },
+	{ 4,   DARK_GREEN },
+	{ 1,   YELLOW },
+	{ 1,   DARK_YELLOW },
+	{ 0xc, MAGENTA },
+	{ 9,   WHITE },
+};
+
+struct front_end front_end = {
+	.color      = YELLOW,
+	.color_tag  = 1,
+	.is_command = true,
+	.is_redraw_needed = true,
+};
+
+/*
+ * Block being edited, its cells are kept on both sides of a gap at the
+ * cursor so that inserting or deleting a word only moves the cells
+ * between the old and the new cursor.
+ */
+struct gap_buffer
+{
+	cell_t       cells[BLOCK_CELLS];
+	unsigned int gap_start;		// Cursor, cells before it are at the start
+	unsigned int gap_end;		// Cells after it are from here to the end
+	cell_t       block;
+	bool         is_dirty;		// Not written back yet
+};
+
+static struct gap_buffer edited = {.block = -1};
+
+// Number or name of a cell, as displayed
+void
+word_text(const cell_t word, char *text, const size_t size)
+{
+	switch (word & 0xf)
+	{
+		case 2:
+		case 5:
+		case 6:
+		case 7:
+		case 8:
+		case 0xf:
+			snprintf(text, size, "%d", word >> 5);
+			break;
+
+		default:
+			snprintf(text, size, "%s", unpack(word));
+			break;
+	}
+}
+
+/*
+ * Gap buffer
+ */
+static unsigned int
+gap_length(void)
+{
+	return BLOCK_CELLS - (edited.gap_end - edited.gap_start);
+}
+
+static cell_t
+gap_cell(const unsigned int i)
+{
+	return edited.cells[i < edited.gap_start ? i
+		: i + edited.gap_end - edited.gap_start];
+}
+
+static void
+gap_move(const unsigned int to)
+{
+	unsigned int n;
+
+	if (to < edited.gap_start)
+	{
+		n = edited.gap_start - to;
+		memmove(&edited.cells[edited.gap_end - n], &edited.cells[to],
+				n * sizeof(cell_t));
+		edited.gap_end -= n;
+	}
+	else
+	{
+		n = to - edited.gap_start;
+		memmove(&edited.cells[edited.gap_start], &edited.cells[edited.gap_end],
+				n * sizeof(cell_t));
+		edited.gap_end += n;
+	}
+
+	edited.gap_start = to;
+}
+
+/*
+ * A word is its cell, the extension cells of a long name and the value
+ * cell after long numbers and variables. The value cell may be past the
+ * end of a block whose trailing empty cells were dropped.
+ */
+static unsigned int
+word_length(const unsigned int i)
+{
+	unsigned int tag = gap_cell(i) & 0xf;
+	unsigned int n = 1;
+
+	if (tag == 2 || tag == 5)
+		n++;
+	else
+	{
+		while (i + n < gap_length() && gap_cell(i + n)
+				&& !(gap_cell(i + n) & 0xf))
+			n++;
+
+		if (tag == 0xc)
+			n++;
+	}
+
+	return n;
+}
+
+static unsigned int
+word_cells(const unsigned int i)
+{
+	unsigned int n = word_length(i);
+
+	return i + n < gap_length() ? n : gap_length() - i;
+}
+
+// Start of the word cell i is in, or of the word before when is_before
+static unsigned int
+word_start(const unsigned int i, const bool is_before)
+{
+	unsigned int start = 0;
+	unsigned int next  = 0;
+
+	while (next < i)
+	{
+		start = next;
+		next += word_cells(next);
+	}
+
+	return next == i && !is_before ? i : start;
+}
+
+static void
+edit_load(const cell_t n)
+{
+	unsigned int cursor = edited.block == n ? edited.gap_start : 0;
+	unsigned int nb_cells, kept;
+	unsigned int used = 0;
+	const cell_t *cells;
+
+	worker_lock_blocks();
+	cells = block_cells(n, &nb_cells);
+	memcpy(&edited.cells[BLOCK_CELLS - nb_cells], cells, nb_cells * sizeof(cell_t));
+	worker_unlock_blocks();
+
+	edited.gap_start = 0;
+	edited.gap_end   = BLOCK_CELLS - nb_cells;
+	edited.block     = n;
+	edited.is_dirty  = false;
+
+	/*
+	 * Raw blocks end with empty cells, they are room to insert. The value
+	 * cell of a variable or a long number is kept even when it is 0, and
+	 * given back when a container dropped it.
+	 */
+	for (unsigned int i = 0; i < nb_cells; i += word_cells(i))
+		if (gap_cell(i))
+			used = i + word_length(i);
+
+	used = used < BLOCK_CELLS ? used : BLOCK_CELLS;
+	kept = used < nb_cells ? used : nb_cells;
+
+	memmove(&edited.cells[BLOCK_CELLS - used], &edited.cells[edited.gap_end],
+			kept * sizeof(cell_t));
+	memset(&edited.cells[BLOCK_CELLS - used + kept], 0,
+			(used - kept) * sizeof(cell_t));
+	edited.gap_end = BLOCK_CELLS - used;
+	nb_cells = used;
+
+	// The block may have changed under the cursor
+	cursor = cursor < nb_cells ? cursor : nb_cells;
+	gap_move(word_start(cursor, false));
+}
+
+/*
+ * The interpreter thread reloads the block once the file is written.
+ * Writing a container reads all the other blocks, which the thread must
+ * not remap meanwhile.
+ */
+static void
+edit_save(void)
+{
+	cell_t cells[BLOCK_CELLS];
+	unsigned int nb_cells = gap_length();
+	int status;
+
+	if (!edited.is_dirty)
+		return;
+
+	for (unsigned int i = 0; i < nb_cells; i++)
+		cells[i] = gap_cell(i);
+
+	worker_lock_blocks();
+	status = block_store_write(edited.block, cells, nb_cells);
+	worker_unlock_blocks();
+
+	if (status == -1)
+		front_end.message = "Error: cannot write the block!";
+	else
+		edited.is_dirty = false;
+}
+
+static void
+edit_insert(const cell_t *cells, const unsigned int nb_cells)
+{
+	if (edited.gap_end - edited.gap_start < nb_cells)
+	{
+		front_end.message = "Error: block is full!";
+		return;
+	}
+
+	memcpy(&edited.cells[edited.gap_start], cells, nb_cells * sizeof(cell_t));
+	edited.gap_start += nb_cells;
+	edited.is_dirty = true;
+}
+
+static void
+edit_delete(const bool is_before)
+{
+	if (is_before && edited.gap_start)
+		edited.gap_start = word_start(edited.gap_start, true);
+	else if (!is_before && edited.gap_start < gap_length())
+		edited.gap_end += word_cells(edited.gap_start);
+	else
+		return;
+
+	edited.is_dirty = true;
+}
+
+// Previous or next definition, or the end of the block
+static void
+edit_jump(const int direction)
+{
+	unsigned int i = edited.gap_start;
+
+	if (direction > 0 && i == gap_length())
+		return;
+
+	do
+		i = direction < 0 ? word_start(i, true) : i + word_cells(i);
+	while (i > 0 && i < gap_length() && (gap_cell(i) & 0xf) != 3);
+
+	gap_move(i);
+}
+
+/*
+ * The typed word with the tag of the color, numbers are short when they
+ * fit in a cell with their tag.
+ */
+static void
+edit_word(const char *text)
+{
+	cell_t cells[BLOCK_CELLS];
+	cell_t color_tag = front_end.color_tag;
+	bool is_compiled = color_tag == 4 || color_tag == 7;
+	char *end;
+	long number = strtol(text, &end, 10);
+	int nb_cells;
+
+	if (*end || color_tag == 3 || color_tag == 0xc || color_tag == 9)
+	{
+		if ((nb_cells = pack_word(text, cells, BLOCK_CELLS - 1)) == -1)
+		{
+			front_end.message = "Error: character not allowed in a word!";
+			return;
+		}
+
+		cells[0] |= color_tag;
+
+		// A variable starts with a value of 0
+		if (color_tag == 0xc)
+			cells[nb_cells++] = 0;
+	}
+	else if (number >= -(1L << 26) && number < (1L << 26))
+	{
+		cells[0] = ((cell_t)number << 5) + (is_compiled ? 6 : 8);
+		nb_cells = 1;
+	}
+	else
+	{
+		cells[0] = is_compiled ? 5 : 2;
+		cells[1] = number;
+		nb_cells = 2;
+	}
+
+	edit_insert(cells, nb_cells);
+}
+
+/*
+ * Cells of the block displayed, with the cursor when it is edited and -1
+ * otherwise.
+ */
+unsigned int
+displayed_cells(cell_t *cells, int *cursor)
+{
+	const cell_t *block;
+	unsigned int nb_cells;
+
+	if (!front_end.is_command && edited.block == front_end.block)
+	{
+		nb_cells = gap_length();
+
+		for (unsigned int i = 0; i < nb_cells; i++)
+			cells[i] = gap_cell(i);
+
+		*cursor = edited.gap_start;
+		return nb_cells;
+	}
+
+	// The interpreter thread may be reloading the blocks
+	worker_lock_blocks();
+	block = block_cells(front_end.block, &nb_cells);
+	memcpy(cells, block, nb_cells * sizeof(cell_t));
+	worker_unlock_blocks();
+
+	*cursor = -1;
+	return nb_cells;
+}
+
+static bool
+is_number(const char *ptr)
+{
+	while (*ptr++)
+	{
+		// Allowed ones are 0 to 9 and NULL
+		if (!((*ptr >= 0x31 && *ptr <= 0x39) || *ptr == 0x00))
+			return false;
+	}
+
+	return true;
+}
+
+static int
+do_cmd(const char *word)
+{
+	cell_t packed;
+
+	if (is_number(word))
+	{
+		packed = ((atoi(word) << 5) & MASK) + INTERPRET_NUMBER_TAG;
+	}
+	else
+	{
+		packed = (pack(word) & 0xfffffff0) | INTERPRET_WORD_TAG;
+	}
+
+	// The interpreter thread looks it up and runs it
+	return worker_submit(packed);
+}
+
+// Written back when leaving a block
+static void
+change_block(const int n)
+{
+	if (!front_end.is_command)
+	{
+		edit_save();
+		edit_load(n);
+	}
+
+	front_end.block = n;
+}
+
+/*
+ * Return shows the block defining the typed word, or the word under the
+ * cursor, then its next definition each time. At the command prompt, it
+ * goes on with the last word.
+ */
+static void
+jump_to_definition(const char *text)
+{
+	static cell_t name;
+	static struct xref_location last = {.block = -1};
+	struct xref_location *locations, *found = NULL, *first = NULL;
+	cell_t cells[BLOCK_CELLS];
+	unsigned int nb_locations;
+	int cell;
+
+	if (*text)
+	{
+		if (pack_word(text, cells, BLOCK_CELLS) == -1)
+		{
+			front_end.message = "Error: character not allowed in a word!";
+			return;
+		}
+
+		name = cells[0];
+	}
+	else if (!front_end.is_command && edited.gap_start < gap_length())
+		name = gap_cell(edited.gap_start);
+	else if (!front_end.is_command || !name)
+		return;
+
+	// The interpreter thread may be reloading the blocks
+	worker_lock_blocks();
+	locations = xref_find(name, &nb_locations);
+	worker_unlock_blocks();
+
+	if (!front_end.is_command)
+		cell = edited.gap_start;
+	else
+		cell = last.block == front_end.block ? last.cell : -1;
+
+	for (unsigned int i = 0; i < nb_locations && !found; i++)
+	{
+		if (locations[i].tag != 3 && locations[i].tag != 0xc)
+			continue;
+
+		if (!first)
+			first = &locations[i];
+
+		if (locations[i].block > front_end.block
+				|| (locations[i].block == front_end.block
+					&& locations[i].cell > cell))
+			found = &locations[i];
+	}
+
+	// Past the last definition, back to the first
+	if (!found && !(found = first))
+		front_end.message = "Error: word not defined in any block!";
+	else
+	{
+		if (found->block != front_end.block)
+			change_block(found->block);
+
+		if (!front_end.is_command)
+			gap_move(word_start(found->cell < gap_length() ? found->cell
+						: gap_length(), false));
+
+		last = *found;
+	}
+
+	free(locations);
+}
+
+/*
+ * Completion from the names of both dictionaries: the names starting with
+ * the word being typed are shown where messages go, Tab extends the word
+ * as far as they all agree.
+ */
+static void
+candidates_update(const char *text)
+{
+	char matches[CANDIDATES_SHOWN][WORD_MAX_LENGTH];
+	char common[WORD_MAX_LENGTH];
+	char *candidates = front_end.candidates;
+	const size_t size = sizeof(front_end.candidates);
+	size_t length = 0;
+	unsigned int nb_matches;
+
+	*candidates = '\0';
+
+	if (!*text)
+		return;
+
+	nb_matches = names_complete(text, matches, CANDIDATES_SHOWN, common);
+
+	for (unsigned int i = 0; i < nb_matches && i < CANDIDATES_SHOWN
+			&& length < size; i++)
+		length += snprintf(&candidates[length], size - length, "%s ", matches[i]);
+
+	if (nb_matches > CANDIDATES_SHOWN && length < size)
+		snprintf(&candidates[length], size - length, "+%u",
+				nb_matches - CANDIDATES_SHOWN);
+}
+
+static void
+complete(char *text)
+{
+	char common[WORD_MAX_LENGTH];
+	size_t room = sizeof(front_end.word) - (text - front_end.word);
+
+	if (*text && names_complete(text, NULL, 0, common)
+			&& strlen(common) > strlen(text))
+		snprintf(text, room, "%s", common);
+}
+
+static void
+handle_edit_key(const enum front_end_key key, const char *text)
+{
+	switch (key)
+	{
+		case KEY_LEFT:
+			gap_move(word_start(edited.gap_start, true));
+			break;
+
+		case KEY_RIGHT:
+			if (edited.gap_start < gap_length())
+				gap_move(edited.gap_start + word_cells(edited.gap_start));
+			break;
+
+		case KEY_UP:
+			edit_jump(-1);
+			break;
+
+		case KEY_DOWN:
+			edit_jump(1);
+			break;
+
+		case KEY_HOME:
+			gap_move(0);
+			break;
+
+		case KEY_END:
+			gap_move(gap_length());
+			break;
+
+		case KEY_DELETE:
+			edit_delete(false);
+			break;
+
+		case KEY_BACKSPACE:
+			edit_delete(true);
+			break;
+
+		case KEY_SPACE:
+			if (*text)
+				edit_word(text);
+			break;
+
+		default:
+			break;
+	}
+}
+
+void
+front_end_key(const enum front_end_key key)
+{
+	char *word = front_end.word;
+	char *str = rindex(word, ' ');
+	char *text = str ? str + 1 : word;	// Without a potential space
+
+	front_end.is_redraw_needed = true;
+
+	if (key >= KEY_F1 && key <= KEY_F8)
+	{
+		front_end.color     = typed_colors[key - KEY_F1].color;
+		front_end.color_tag = typed_colors[key - KEY_F1].tag;
+		return;
+	}
+
+	switch (key)
+	{
+		case KEY_F9:
+			edit_save();
+			front_end.is_command = true;
+			break;
+
+		case KEY_F10:
+			if (front_end.is_command)
+			{
+				front_end.is_command = false;
+				edit_load(front_end.block);
+			}
+			break;
+
+		case KEY_F11:
+			front_end.is_overlay_shown = !front_end.is_overlay_shown;
+			break;
+
+		case KEY_F12:
+			edit_save();
+			break;
+
+		case KEY_PAGE_DOWN:
+			if (front_end.block + 1 < block_count())
+				change_block(front_end.block + 1);
+			break;
+
+		case KEY_PAGE_UP:
+			if (front_end.block - 1 >= 0)
+				change_block(front_end.block - 1);
+			break;
+
+		case KEY_BACKSPACE:
+			if (*text)
+				text[strlen(text) - 1] = '\0';
+			else if (!front_end.is_command)
+				handle_edit_key(key, text);
+			break;
+
+		case KEY_SPACE:
+			front_end.message = NULL;
+
+			if (!front_end.is_command)
+				handle_edit_key(key, text);
+			else if (do_cmd(text) == -1)
+				front_end.message = "Error: too many words waiting!";
+
+			memset(word, 0, sizeof(front_end.word));
+			break;
+
+		case KEY_ESCAPE:
+			colorforth_interrupt();
+			break;
+
+		case KEY_RETURN:
+			front_end.message = NULL;
+			jump_to_definition(text);
+			memset(word, 0, sizeof(front_end.word));
+			break;
+
+		case KEY_TAB:
+			complete(text);
+			break;
+
+		default:
+			if (!front_end.is_command)
+				handle_edit_key(key, text);
+			break;
+	}
+
+	candidates_update(text);
+}
+
+void
+front_end_text(const char *text)
+{
+	size_t length = strlen(front_end.word);
+	char *space;
+
+	strncat(front_end.word, text, sizeof(front_end.word) - length - 1);
+	front_end.is_redraw_needed = true;
+
+	space = rindex(front_end.word, ' ');
+	candidates_update(space ? space + 1 : front_end.word);
+}
+
+// A snapshot was published by the interpreter thread
+void
+front_end_snapshot(void)
+{
+	struct worker_snapshot *snapshot;
+
+	if (!(snapshot = worker_snapshot()))
+		return;
+
+	free(front_end.stack);
+	front_end.stack   = strdup(snapshot->stack);
+	front_end.message = snapshot->is_word_missing ? "Error: word not found!" : NULL;
+
+	// Follow changes made outside, own changes are already there
+	if (snapshot->are_blocks_changed && !front_end.is_command && !edited.is_dirty)
+		edit_load(front_end.block);
+
+	worker_snapshot_free(snapshot);
+	front_end.is_redraw_needed = true;
+}
+
+int
+front_end_start(const char *path, void (*published)(void))
+{
+	if (block_store_open(path) == -1)
+		return -1;
+
+	colorforth_initialize();
+
+	return worker_start(published);
+}
+
+void
+front_end_stop(void)
+{
+	edit_save();
+	worker_stop();
+	colorforth_finalize();
+	block_store_close();
+
+	free(front_end.stack);
+	front_end.stack = NULL;
+}
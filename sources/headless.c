@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Run blocks without the editor, for batch jobs and benchmarks. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "colorforth.h"
+
+#define PROFILE_FREQUENCY 997	// Hz, not a multiple of common periods
+#define WATCH_PERIOD      100000	// us between checks of the block file
+
+static void
+usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-n] [-t] [-w] [-c] [-o] [-f fuel [-s slices]]"
+			" [-p folded.txt] blocks.cf block...\n"
+			"  -n  compile to native subroutine-threaded code\n"
+			"  -t  report the time spent in each block\n"
+			"  -f  run blocks in slices of that many calls and backward branches\n"
+			"  -s  stop a block after that many slices\n"
+			"  -c  start with the block file out of the page cache\n"
+			"  -o  read blocks on demand only, loads doesn't read ahead\n"
+			"  -p  profile, print time per word and write folded stacks\n"
+			"  -w  watch the blocks, run those that change again\n",
+			program);
+	exit(EXIT_FAILURE);
+}
+
+static void
+block_changed(const cell_t n)
+{
+	fprintf(stderr, "block %d changed\n", n);
+	reload_block(n);
+}
+
+static void
+print_stack(void)
+{
+	char *stack_content = dot_s();
+
+	printf("%s\n", stack_content);
+	fflush(stdout);
+	free(stack_content);
+}
+
+// Cold start, for benchmarks of block reads
+static void
+evict(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0)
+		fprintf(stderr, "Error: cannot evict %s from the page cache!\n", path);
+
+	if (fd != -1)
+		close(fd);
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec)
+		+ (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	bool native = false;
+	bool timing = false;
+	bool watch = false;
+	bool cold = false;
+	char *profile = NULL;
+	long fuel = 0;
+	long max_slices = 0;
+	long slices;
+	FILE *folded;
+	struct timespec start;
+	int option;
+
+	while ((option = getopt(argc, argv, "ntwcof:s:p:")) != -1)
+	{
+		switch (option)
+		{
+			case 'n':
+				native = true;
+				break;
+
+			case 't':
+				timing = true;
+				break;
+
+			case 'w':
+				watch = true;
+				break;
+
+			case 'c':
+				cold = true;
+				break;
+
+			case 'o':
+				block_prefetch_enable(false);
+				break;
+
+			case 'f':
+				fuel = atol(optarg);
+				break;
+
+			case 's':
+				max_slices = atol(optarg);
+				break;
+
+			case 'p':
+				profile = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (optind + 2 > argc)
+		usage(argv[0]);
+
+	if (cold)
+		evict(argv[optind]);
+
+	if (block_store_open(argv[optind]) == -1)
+		exit(EXIT_FAILURE);
+
+	colorforth_initialize();
+
+	if (native && set_compile_mode(SUBROUTINE_THREADED_CODE) == -1)
+	{
+		fprintf(stderr, "Error: native code is not available here!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (profile && profiler_start(PROFILE_FREQUENCY) == -1)
+	{
+		fprintf(stderr, "Error: cannot start the profiler!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = optind + 1; i < argc; i++)
+	{
+		unsigned long switches = task_switch_count();
+		double seconds;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		set_fuel(fuel);
+		run_block(atoi(argv[i]));
+
+		// Out of fuel, the block goes on where it was suspended
+		for (slices = 1; is_run_suspended(); slices++)
+		{
+			if (max_slices && slices == max_slices)
+			{
+				fprintf(stderr, "block %s: stopped after %ld slices\n",
+						argv[i], slices);
+				drop_run();
+				break;
+			}
+
+			resume_run();
+		}
+
+		seconds  = elapsed(&start);
+		switches = task_switch_count() - switches;
+
+		if (timing && switches)
+			fprintf(stderr, "block %s: %.6f s, %lu task switches, %.0f/s\n",
+					argv[i], seconds, switches, switches / seconds);
+		else if (timing && fuel)
+			fprintf(stderr, "block %s: %.6f s, %ld slices\n", argv[i], seconds,
+					slices);
+		else if (timing)
+			fprintf(stderr, "block %s: %.6f s\n", argv[i], seconds);
+	}
+
+	if (profile)
+	{
+		if (!(folded = fopen(profile, "w")))
+		{
+			perror("fopen");
+			exit(EXIT_FAILURE);
+		}
+
+		profiler_stop(stderr, folded);
+		fclose(folded);
+	}
+
+	print_stack();
+
+	if (watch && block_store_watch() == 0)
+	{
+		for (;;)
+		{
+			usleep(WATCH_PERIOD);
+
+			if (block_store_poll(block_changed) > 0)
+				print_stack();
+		}
+	}
+
+	colorforth_finalize();
+	block_store_close();
+
+	return 0;
+}
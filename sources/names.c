@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Names of the words of both dictionaries, for completion at the prompt
+ *
+ * A sorted array of the unpacked names: the words of a prefix are next
+ * to each other and found with two binary searches. Definitions are
+ * appended as they are created, on the interpreter thread, and merged in
+ * the next time the front end asks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "colorforth.h"
+
+typedef char name_t[WORD_MAX_LENGTH];
+
+static name_t *names;		// Sorted ones first, then the ones added
+static size_t  nb_sorted;
+static size_t  nb_added;
+static size_t  names_size;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+name_compare(const void *a, const void *b)
+{
+	return strcmp(a, b);
+}
+
+// Sort the names added and merge them in, names defined again once
+static void
+merge(void)
+{
+	name_t *merged;
+	size_t i = 0, j = nb_sorted, n = 0;
+	const size_t end = nb_sorted + nb_added;
+	const char *next;
+
+	qsort(&names[nb_sorted], nb_added, sizeof(name_t), name_compare);
+
+	if (!(merged = malloc(names_size * sizeof(name_t))))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (i < nb_sorted || j < end)
+	{
+		if (j == end || (i < nb_sorted && strcmp(names[i], names[j]) <= 0))
+			next = names[i++];
+		else
+			next = names[j++];
+
+		if (!n || strcmp(merged[n - 1], next))
+			memcpy(merged[n++], next, sizeof(name_t));
+	}
+
+	free(names);
+	names     = merged;
+	nb_sorted = n;
+	nb_added  = 0;
+}
+
+// First sorted name not before text, or past it when is_after
+static size_t
+search(const char *text, const size_t length, const bool is_after)
+{
+	size_t low = 0, high = nb_sorted, middle;
+	int order;
+
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		order  = strncmp(names[middle], text, length);
+
+		if (order < 0 || (is_after && order == 0))
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low;
+}
+
+void
+name_add(const cell_t word)
+{
+	const char *name = unpack(word);
+
+	pthread_mutex_lock(&lock);
+
+	if (nb_sorted + nb_added == names_size)
+	{
+		names_size = names_size ? names_size * 2 : 256;
+
+		if (!(names = realloc(names, names_size * sizeof(name_t))))
+		{
+			fprintf(stderr, "Error: Not enough memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	snprintf(names[nb_sorted + nb_added++], sizeof(name_t), "%s", name);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void
+names_clear(void)
+{
+	pthread_mutex_lock(&lock);
+
+	free(names);
+	names     = NULL;
+	nb_sorted = nb_added = names_size = 0;
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Names starting with text: the first max of them go in matches and
+ * their longest common start in common. Returns how many there are.
+ */
+unsigned int
+names_complete(const char *text, char (*matches)[WORD_MAX_LENGTH],
+		const unsigned int max, char *common)
+{
+	size_t length = strlen(text);
+	size_t first, last, n = 0;
+
+	pthread_mutex_lock(&lock);
+
+	if (nb_added)
+		merge();
+
+	first = search(text, length, false);
+	last  = search(text, length, true);
+
+	for (size_t i = first; i < last && i - first < max; i++)
+		memcpy(matches[i - first], names[i], sizeof(name_t));
+
+	// Sorted, what all share is what the first and the last share
+	if (first < last)
+	{
+		while (names[first][n] && names[first][n] == names[last - 1][n])
+			n++;
+
+		memcpy(common, names[first], n);
+	}
+
+	common[n] = '\0';
+
+	pthread_mutex_unlock(&lock);
+
+	return last - first;
+}
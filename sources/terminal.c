@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Terminal front end
+ *
+ * Blocks are drawn with 24-bit ANSI colors, over ssh or on servers
+ * without a display, with the keys of the SDL editor. The screen is
+ * kept as a grid of cells: each frame is drawn into it from scratch and
+ * only the cells that differ from what the terminal shows are sent.
+ *
+ * The interpreter writes its traces to stdout and stderr, they go to a
+ * log file instead of the screen.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "colorforth.h"
+
+#define ESCAPE_TIMEOUT 25	// ms without a following byte for the Escape key
+#define FRAME_PERIOD   16	// ms, while the frame times are shown
+#define CTRL_Q         0x11	// Quits
+
+struct screen_cell
+{
+	char       c;
+	struct rgb color;
+	bool       is_cursor;
+};
+
+static const struct rgb cursor_color = {0, 12, 125};
+static const struct rgb yellow       = {255, 255, 0};
+static const struct rgb red          = {234, 8, 8};
+static const struct rgb white        = {255, 255, 255};
+
+static int                 tty = -1;		// The terminal, stdout is the log
+static struct termios      saved_mode;
+static int                 columns, rows;
+static struct screen_cell *screen;		// Frame being drawn
+static struct screen_cell *shown;		// On the terminal
+static volatile sig_atomic_t is_resized = 1;
+static int                 wake[2];		// Snapshots and resizes
+static bool                done;
+
+static char   *output;
+static size_t  output_length, output_size;
+
+// For the overlay
+static double  frame_build_ms;
+static size_t  frame_bytes;
+
+// Where the next word goes, as in display_word()
+static int  x, y;
+static bool is_first_definition;
+
+/*
+ * Output
+ */
+static void
+emit(const char *text, const size_t length)
+{
+	if (output_length + length > output_size)
+	{
+		output_size = (output_length + length) * 2;
+
+		if (!(output = realloc(output, output_size)))
+		{
+			fprintf(stderr, "Error: Not enough memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memcpy(&output[output_length], text, length);
+	output_length += length;
+}
+
+static void
+emit_format(const char *format, const int a, const int b, const int c)
+{
+	char text[32];
+	int length = snprintf(text, sizeof(text), format, a, b, c);
+
+	emit(text, length);
+}
+
+static void
+flush_output(void)
+{
+	size_t written = 0;
+	ssize_t n;
+
+	while (written < output_length
+			&& (n = write(tty, &output[written], output_length - written)) > 0)
+		written += n;
+
+	frame_bytes   = output_length;
+	output_length = 0;
+}
+
+/*
+ * Terminal
+ */
+static void
+terminal_restore(void)
+{
+	static const char leave[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+
+	if (tty == -1)
+		return;
+
+	if (write(tty, leave, sizeof(leave) - 1) == -1)
+		perror("write");
+
+	tcsetattr(tty, TCSAFLUSH, &saved_mode);
+	close(tty);
+	tty = -1;
+}
+
+static int
+terminal_setup(void)
+{
+	static const char enter[] = "\x1b[?1049h\x1b[?25l";
+	struct termios mode;
+
+	if ((tty = dup(STDOUT_FILENO)) == -1 || tcgetattr(tty, &saved_mode) == -1)
+	{
+		perror("terminal");
+		return -1;
+	}
+
+	mode = saved_mode;
+	mode.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+	mode.c_oflag &= ~OPOST;
+	mode.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+	mode.c_cflag |= CS8;
+	mode.c_cc[VMIN]  = 1;
+	mode.c_cc[VTIME] = 0;
+
+	if (tcsetattr(tty, TCSAFLUSH, &mode) == -1)
+	{
+		perror("terminal");
+		return -1;
+	}
+
+	atexit(terminal_restore);
+	emit(enter, sizeof(enter) - 1);
+
+	return 0;
+}
+
+static void
+window_changed(int signum)
+{
+	ssize_t written;
+
+	(void)signum;
+
+	is_resized = 1;
+	written = write(wake[1], "w", 1);
+	(void)written;
+}
+
+// Both grids are made again, everything is sent on the next frame
+static void
+resize(void)
+{
+	struct winsize size;
+
+	is_resized = 0;
+
+	if (ioctl(tty, TIOCGWINSZ, &size) == -1 || !size.ws_col || size.ws_row < 4)
+	{
+		size.ws_col = 80;
+		size.ws_row = 24;
+	}
+
+	columns = size.ws_col;
+	rows    = size.ws_row;
+
+	free(screen);
+	free(shown);
+	screen = malloc(columns * rows * sizeof(*screen));
+	shown  = calloc(columns * rows, sizeof(*shown));
+
+	if (!screen || !shown)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	emit("\x1b[0m\x1b[2J", 8);
+}
+
+/*
+ * Drawing, into the grid
+ */
+static void
+put_text(int column, const int row, const char *text, const struct rgb color)
+{
+	for (; *text && column < columns; text++, column++)
+	{
+		if (column < 0 || row < 0 || row >= rows)
+			continue;
+
+		screen[row * columns + column].c     = *text;
+		screen[row * columns + column].color = color;
+	}
+}
+
+static void
+put_cursor(const int column, const int row)
+{
+	if (column >= 0 && column < columns && row >= 0 && row < rows)
+		screen[row * columns + column].is_cursor = true;
+}
+
+static void
+display_word(const cell_t word)
+{
+	uint8_t word_color = word & 0x0000000f;
+	static struct rgb color;
+	char text[WORD_MAX_LENGTH];
+	int length;
+
+	if (word_color == 0xd || word_color == 0xe)
+		return;
+
+	word_text(word, text, WORD_MAX_LENGTH);
+	length = strlen(text);
+
+	// Extension cells keep the color of their word
+	if (word_color)
+		color = palette[word_color];
+
+	if (word_color == 0)
+		x--; // Go back to hide a space
+	else if (word_color == 3)
+	{
+		if (is_first_definition)
+			is_first_definition = false;
+		else
+			y++;
+		x = 0;
+	}
+	else if (x + length > columns)
+	{
+		y++;
+		x = 0;
+	}
+
+	// The last rows are the prompt, the stack and the message
+	if (y < rows - 3)
+		put_text(x, y, text, color);
+
+	x += length + 1;
+}
+
+static void
+display_block(void)
+{
+	cell_t cells[BLOCK_CELLS];
+	int cursor;
+	unsigned int nb_cells = displayed_cells(cells, &cursor);
+
+	x = y = 0;
+	is_first_definition = true;
+
+	for (unsigned int i = 0; i < nb_cells; i++)
+	{
+		if ((int)i == cursor && y < rows - 3)
+			put_cursor(x ? x - 1 : 0, y);
+
+		display_word(cells[i]);
+	}
+
+	if ((int)nb_cells == cursor && y < rows - 3)
+		put_cursor(x ? x - 1 : 0, y);
+}
+
+static void
+display_status(void)
+{
+	char block_info[30];
+	char times[64];
+
+	put_text(0, rows - 3, "> ", yellow);
+	put_text(2, rows - 3, front_end.word, front_end.color);
+	put_cursor(2 + strlen(front_end.word), rows - 3);
+
+	if (worker_is_busy())
+		put_text(columns - 40, rows - 3, "Running, Escape interrupts", yellow);
+
+	snprintf(block_info, sizeof(block_info), "Block: %d", front_end.block);
+	put_text(columns - 12, rows - 3, block_info, yellow);
+
+	put_text(0, rows - 2, front_end.stack ? front_end.stack : "", yellow);
+
+	if (front_end.message)
+		put_text(0, rows - 1, front_end.message, red);
+	else
+		put_text(0, rows - 1, front_end.candidates, white);
+
+	if (front_end.is_overlay_shown)
+	{
+		snprintf(times, sizeof(times), "frame %.2f ms, %zu bytes",
+				frame_build_ms, frame_bytes);
+		put_text(columns - strlen(times), 0, times, white);
+	}
+}
+
+/*
+ * Send the cells that changed, moving and changing colors only when the
+ * next one isn't right after the previous one or differs in color.
+ */
+static void
+present_frame(void)
+{
+	struct timespec start, end;
+	struct screen_cell *cell, *old;
+	struct rgb color = {0, 0, 0};
+	bool is_cursor = false, is_pen_set = false;
+	int pen = -1;	// Where the terminal writes next
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (is_resized)
+		resize();
+
+	for (int i = 0; i < columns * rows; i++)
+		screen[i] = (struct screen_cell){.c = ' ', .color = white};
+
+	display_block();
+	display_status();
+
+	for (int i = 0; i < columns * rows; i++)
+	{
+		cell = &screen[i];
+		old  = &shown[i];
+
+		if (cell->c == old->c && cell->is_cursor == old->is_cursor
+				&& (cell->c == ' ' || !memcmp(&cell->color, &old->color,
+						sizeof(struct rgb))))
+			continue;
+
+		if (pen != i)
+			emit_format("\x1b[%d;%dH", i / columns + 1, i % columns + 1, 0);
+
+		if (!is_pen_set || memcmp(&cell->color, &color, sizeof(struct rgb)))
+		{
+			color = cell->color;
+			emit_format("\x1b[38;2;%d;%d;%dm", color.r, color.g, color.b);
+		}
+
+		if (!is_pen_set || cell->is_cursor != is_cursor)
+		{
+			is_cursor = cell->is_cursor;
+
+			if (is_cursor)
+				emit_format("\x1b[48;2;%d;%d;%dm", cursor_color.r,
+						cursor_color.g, cursor_color.b);
+			else
+				emit("\x1b[49m", 5);
+		}
+
+		is_pen_set = true;
+		emit(&cell->c, 1);
+		pen = i + 1;
+		*old = *cell;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	frame_build_ms = (end.tv_sec - start.tv_sec) * 1e3
+		+ (end.tv_nsec - start.tv_nsec) / 1e6;
+
+	flush_output();
+	front_end.is_redraw_needed = false;
+}
+
+/*
+ * Input
+ */
+static const struct
+{
+	const char         *sequence;	// After the escape
+	enum front_end_key key;
+} sequences[] = {
+	{ "OP", KEY_F1 },	{ "OQ", KEY_F2 },	{ "OR", KEY_F3 },
+	{ "OS", KEY_F4 },	{ "[11~", KEY_F1 },	{ "[12~", KEY_F2 },
+	{ "[13~", KEY_F3 },	{ "[14~", KEY_F4 },	{ "[15~", KEY_F5 },
+	{ "[17~", KEY_F6 },	{ "[18~", KEY_F7 },	{ "[19~", KEY_F8 },
+	{ "[20~", KEY_F9 },	{ "[21~", KEY_F10 },	{ "[23~", KEY_F11 },
+	{ "[24~", KEY_F12 },	{ "[5~", KEY_PAGE_UP },	{ "[6~", KEY_PAGE_DOWN },
+	{ "[A", KEY_UP },	{ "[B", KEY_DOWN },	{ "[C", KEY_RIGHT },
+	{ "[D", KEY_LEFT },	{ "[H", KEY_HOME },	{ "[F", KEY_END },
+	{ "OH", KEY_HOME },	{ "OF", KEY_END },	{ "[1~", KEY_HOME },
+	{ "[4~", KEY_END },	{ "[7~", KEY_HOME },	{ "[8~", KEY_END },
+	{ "[3~", KEY_DELETE },
+};
+
+static bool
+is_input_pending(const int timeout)
+{
+	struct pollfd input = {.fd = STDIN_FILENO, .events = POLLIN};
+
+	return poll(&input, 1, timeout) == 1;
+}
+
+// Length of the escape sequence at text, its key is set when it is known
+static size_t
+escape_sequence(const char *text, const size_t length, int *key)
+{
+	size_t n;
+
+	*key = -1;
+
+	for (size_t i = 0; i < sizeof(sequences) / sizeof(sequences[0]); i++)
+	{
+		n = strlen(sequences[i].sequence);
+
+		if (n <= length && !memcmp(text, sequences[i].sequence, n))
+		{
+			*key = sequences[i].key;
+			return n;
+		}
+	}
+
+	// Skip the ones without a key, up to their final byte
+	if (length && (text[0] == '[' || text[0] == 'O'))
+	{
+		for (n = 1; n < length && (text[n] < 0x40 || text[n] > 0x7e); n++)
+			;
+
+		return n < length ? n + 1 : length;
+	}
+
+	return 0;
+}
+
+static void
+read_keys(void)
+{
+	char input[64];
+	ssize_t length = read(STDIN_FILENO, input, sizeof(input) - 1);
+	ssize_t more;
+	size_t n;
+	int key;
+
+	for (ssize_t i = 0; i < length; i++)
+	{
+		char c = input[i];
+
+		if (c == 0x1b)
+		{
+			// The rest of a sequence may come in the next read
+			if (i == length - 1 && length < (ssize_t)sizeof(input) - 1
+					&& is_input_pending(ESCAPE_TIMEOUT)
+					&& (more = read(STDIN_FILENO, &input[length],
+							sizeof(input) - 1 - length)) > 0)
+				length += more;
+
+			n = escape_sequence(&input[i + 1], length - i - 1, &key);
+
+			if (!n)
+				front_end_key(KEY_ESCAPE);
+			else if (key != -1)
+				front_end_key(key);
+
+			i += n;
+		}
+		else if (c == CTRL_Q)
+			done = true;
+		else if (c == 0x7f || c == 0x08)
+			front_end_key(KEY_BACKSPACE);
+		else if (c == ' ')
+			front_end_key(KEY_SPACE);
+		else if (c == '\r' || c == '\n')
+			front_end_key(KEY_RETURN);
+		else if (c == '\t')
+			front_end_key(KEY_TAB);
+		else if (c > ' ' && c < 0x7f)
+			front_end_text((char []){c, '\0'});
+	}
+}
+
+// Runs on the interpreter thread, the snapshot is read by the event loop
+static void
+snapshot_published(void)
+{
+	if (write(wake[1], "s", 1) == -1)
+		perror("write");
+}
+
+static void
+usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-l log.txt] [blocks.cf]\n"
+			"  -l  write the interpreter output there instead of /dev/null\n",
+			program);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *log = "/dev/null";
+	const char *path = "blocks/blocks.cf";
+	struct pollfd events[2];
+	char wakes[16];
+	ssize_t nb_wakes;
+	int option;
+
+	while ((option = getopt(argc, argv, "l:")) != -1)
+	{
+		if (option != 'l')
+			usage(argv[0]);
+
+		log = optarg;
+	}
+
+	if (optind < argc)
+		path = argv[optind];
+
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO))
+	{
+		fprintf(stderr, "Error: not a terminal!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pipe(wake) == -1 || terminal_setup() == -1)
+		exit(EXIT_FAILURE);
+
+	// The screen is ours, what the interpreter prints goes to the log
+	if (!freopen(log, "a", stdout) || dup2(fileno(stdout), STDERR_FILENO) == -1)
+	{
+		perror(log);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGWINCH, window_changed);
+
+	if (front_end_start(path, snapshot_published) == -1)
+		exit(EXIT_FAILURE);
+
+	events[0] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+	events[1] = (struct pollfd){.fd = wake[0], .events = POLLIN};
+
+	while (!done)
+	{
+		if (front_end.is_redraw_needed || front_end.is_overlay_shown || is_resized)
+			present_frame();
+
+		if (poll(events, 2, front_end.is_overlay_shown ? FRAME_PERIOD : -1) <= 0)
+			continue;
+
+		if (events[1].revents & POLLIN
+				&& (nb_wakes = read(wake[0], wakes, sizeof(wakes))) > 0
+				&& memchr(wakes, 's', nb_wakes))
+			front_end_snapshot();
+
+		if (events[0].revents & POLLIN)
+			read_keys();
+		else if (events[0].revents & (POLLHUP | POLLERR))
+			done = true;
+	}
+
+	front_end_stop();
+	terminal_restore();
+
+	free(screen);
+	free(shown);
+	free(output);
+
+	return 0;
+}
@@ -1,12 +1,29 @@
 /*
  * Copyright (c) Andrei Dragomir.
  * All rights reserved.
- * Use of this source code is governed by a BSD-style license that can be 
+ * Use of this source code is governed by a BSD-style license that can be
  * found in the LICENSE file.
  */
 
-/* Convert colorForth to html */
+/*
+ * Convert colorForth to html
+ *
+ * Usage: cf2html [-b first[-last]] [-t] [blocks.cf...] > blocks.html
+ *
+ * Files are mapped and decoded a block at a time, the html goes through a
+ * large buffer. Without file, blocks are read from stdin.
+ */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define BLOCK_CELLS 256
+#define OUTPUT_SIZE (1 << 20)
 
 char ch[] = {' ', 'r', 't', 'o', 'e', 'a', 'n', 'i',
 	's', 'm', 'c', 'y', 'l', 'g', 'f', 'w',
@@ -15,220 +32,425 @@ char ch[] = {' ', 'r', 't', 'o', 'e', 'a', 'n', 'i',
 	'8', '9', 'j', '-', 'k', '.', 'z', '/',
 	';', ':', '!', '+', '@', '*', ',', '?'};
 
-void print_text(unsigned int t)
+char *function[] = {
+	"extension", "execute", "execute", "define",
+	"compile", "compile", "compile", "compilemacro",
+	"execute", "text", "textcapitalized", "textallcaps",
+	"variable", "compiler_feedback", "display_macro", "commented_number",
+	"", "", "executehex", "",
+	"", "compilehex", "compilehex", "",
+	"executehex", "", "", "",
+	"", "", "", "commented_number"
+};
+
+char hex[] = {'0', '1', '2', '3', '4', '5', '6', '7',
+	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
+
+char header[] =
+	"<html>\n"
+	"<link rel=stylesheet type=\"text/css\" href=\"colorforth.css\">\n"
+	"  <style type=\"text/css\">\n"
+	"  body { margin-right:10%;}\n"
+	"  div.code {\n"
+	"    width:100%;\n"
+	"    padding:0.5em;\n"
+	"    background-color:black;\n"
+	"    font-size:xx-large;\n"
+	"    font-weight:bold;\n"
+	"    text-transform:lowercase;\n"
+	"  }\n"
+	"  code.define { color:red; }\n"
+	"  code.compile { color:#00ff00; }\n"
+	"  code.compilehex { color:green; }\n"
+	"  code.execute { color:yellow; }\n"
+	"  code.executehex { color:#c0c000; }\n"
+	"  code.compilemacro { color:#00ffff; }\n"
+	"  code.variable {color:#ff00ff; }\n"
+	"  code.text { color:white; }\n"
+	"  code.textcapitalized { color:white; text-transform:capitalize; }\n"
+	"  code.textallcaps { color:white; text-transform:uppercase; }\n"
+	"  code.display_macro { color:#0000FF; }\n"
+	"  code.compiler_feedback { color:grey; }\n"
+	"  code.commented_number { color:white; }\n"
+	"  </style>\n";
+
+/*
+ * Output buffer, flushed before a block when it may not fit
+ */
+char *out;
+size_t out_len;
+size_t out_total;
+
+void flush_output(void)
 {
-	while (t)
+	if (fwrite(out, 1, out_len, stdout) != out_len)
+	{
+		perror("write");
+		exit(EXIT_FAILURE);
+	}
+
+	out_total += out_len;
+	out_len = 0;
+}
+
+void put_char(char c)
+{
+	out[out_len++] = c;
+}
+
+void put_bytes(const char *s, size_t length)
+{
+	if (out_len + length > OUTPUT_SIZE)
+	{
+		flush_output();
+		fwrite(s, 1, length, stdout);
+		out_total += length;
+		return;
+	}
+
+	memcpy(&out[out_len], s, length);
+	out_len += length;
+}
+
+void put_string(const char *s)
+{
+	put_bytes(s, strlen(s));
+}
+
+#define put_literal(s) put_bytes(s, sizeof(s) - 1)
+
+void put_number(unsigned long n)
+{
+	char digits[24];
+	int i = sizeof(digits);
+
+	do
+	{
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	memcpy(&out[out_len], &digits[i], sizeof(digits) - i);
+	out_len += sizeof(digits) - i;
+}
+
+/*
+ * A character is 4, 5 or 7 bits long, the top 7 bits of a cell are
+ * enough to find it and its length.
+ */
+struct decoded
+{
+	char letter;
+	char length;
+} decode[128];
+
+void build_decode_table(void)
+{
+	for (unsigned int i = 0; i < 128; i++)
 	{
+		unsigned int t = i << 25;
+
 		if (!(t & 0x80000000))
-		{
-			putchar(ch[t >> 28]);
-			t <<= 4;
-		}
+			decode[i] = (struct decoded){ch[t >> 28], 4};
 		else if ((t & 0xc0000000) == 0x80000000)
-		{
-			putchar(ch[8 + ((t >> 27) & 7)]);
-			t <<= 5;
-		}
+			decode[i] = (struct decoded){ch[8 + ((t >> 27) & 7)], 5};
 		else
-		{
-			putchar(ch[((t >> 28) - 10) * 8 + ((t >> 25) & 7)]);
-			t <<= 7;
-		}
+			decode[i] = (struct decoded){ch[((t >> 28) - 10) * 8 + ((t >> 25) & 7)], 7};
 	}
 }
 
-char *function[] = {
-	"extension", "execute", "execute", "define", 
-	"compile", "compile", "compile", "compilemacro", 
-	"execute", "text", "textcapitalized", "textallcaps",
-	"variable", "compiler_feedback", "display_macro", "commented_number",
-	"", "", "executehex", "",  
-	"", "compilehex", "compilehex", "", 
-	"executehex", "", "", "", 
-	"", "", "", "commented_number"
-};
+void print_text(unsigned int t)
+{
+	while (t)
+	{
+		struct decoded d = decode[t >> 25];
+
+		out[out_len++] = d.letter;
+		t <<= d.length;
+	}
+}
 
 void print_tags(int p, int t)
 {
 	if (p)
-		printf("</code>");
+		put_literal("</code>");
 	if (t == 3 && p)
-		printf("<br>");
+		put_literal("<br>");
 
-	printf("<code class=%s>", function[t]);
+	put_literal("<code class=");
+	put_string(function[t]);
+	put_char('>');
 
 	if (t != 3)
-		putchar(' ');
+		put_char(' ');
 }
 
-char hex[] = {'0', '1', '2', '3', '4', '5', '6', '7',
-	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'};
-
 void print_hex(unsigned int i)
 {
-	int n = 8, f = 0;
+	int n = 8;
 
 	if (i == 0)
 	{
-		putchar('0'); return;
+		put_char('0'); return;
+	}
+
+	while (!(i & 0xf0000000))
+	{
+		i <<= 4; n--;
 	}
 
 	while (n--)
 	{
-		if (!(i & 0xf0000000))
-		{
-			if (f)
-				putchar('0');
-		}
-		else
-		{
-			f = 1;
-			putchar(hex [i >> 28]);
-		}
+		put_char(hex[i >> 28]);
 		i <<= 4;
 	}
 }
 
 void print_dec(int i)
 {
-	int j, k, f = 0;
+	if (i < 0)
+	{
+		put_char('-');
+		put_number(-(long)i);
+	}
+	else
+		put_number(i);
+}
 
-	if (i == 0)
+/*
+ * Cells are numbered by their end offset in the file, blocks by their
+ * position. The last block of a file closes the html code without rule.
+ */
+void print_block(const unsigned int *cells, int nb_cells, int b, int last)
+{
+	int pos, p = 0;
+
+	put_literal("{block ");
+	put_number(b);
+	put_literal("}\n<div class=code>\n");
+
+	for (int w = 0; w < nb_cells; w++)
 	{
-		putchar('0'); return;
+		unsigned int t = cells[w];
+
+		put_literal("<!-- pos: ");
+		put_number((b * BLOCK_CELLS + w + 1) * 4);
+		put_literal(" -->");
+
+		switch (t & 0xf)
+		{
+			case 0:
+				print_text(t & 0xfffffff0);
+				break;
+			case 2:
+			case 5:
+				print_tags(p, t & 0x1f);
+				if (w == BLOCK_CELLS - 1)
+					break;
+				pos = ++w;
+				if (t & 0x10)
+					print_hex(pos < nb_cells ? cells[pos] : 0);
+				else
+					print_dec(pos < nb_cells ? cells[pos] : 0);
+				break;
+			case 6:
+			case 8:
+			case 0xf:
+				print_tags(p, t & 0x1f);
+				if (t & 0x10)
+					print_hex((int)t >> 5);
+				else
+					print_dec((int)t >> 5);
+				break;
+			case 0xc: // variable
+				print_tags(p, t & 0xf);
+				print_text(t & 0xfffffff0);
+				if (w == BLOCK_CELLS - 1)
+					break;
+				pos = ++w;
+				print_tags(1, 4);
+				print_dec(pos < nb_cells ? cells[pos] : t);
+				break;
+			default:
+				print_tags(p, t & 0xf);
+				print_text(t & 0xfffffff0);
+				break;
+		}
+
+		p = 1;
 	}
 
-	if (i < 0)
+	if (last)
+		put_literal("</code>\n</div>\n");
+	else
+		put_literal("</code>\n</div>\n<hr>\n");
+}
+
+void print_blocks(const unsigned int *cells, size_t nb_cells, int first, int last)
+{
+	int nb_blocks = (nb_cells + BLOCK_CELLS - 1) / BLOCK_CELLS;
+
+	if (last < 0 || last >= nb_blocks)
+		last = nb_blocks - 1;
+
+	for (int b = first; b <= last; b++)
 	{
-		putchar('-'); i = -i;
+		int n = b < nb_blocks - 1 ? BLOCK_CELLS : nb_cells - b * BLOCK_CELLS;
+
+		// A cell is at most about 100 bytes of html
+		if (out_len > OUTPUT_SIZE - 128 * BLOCK_CELLS)
+			flush_output();
+
+		print_block(&cells[b * BLOCK_CELLS], n, b, b == nb_blocks - 1);
 	}
+}
+
+/*
+ * Bulk read what can't be mapped, like a pipe
+ */
+void *read_all(int fd, size_t *size)
+{
+	size_t capacity = OUTPUT_SIZE;
+	char *data = malloc(capacity);
+	ssize_t n;
+
+	*size = 0;
 
-	for (j = 1000000000; j != 0; j /= 10)
+	while (data && (n = read(fd, data + *size, capacity - *size)) > 0)
 	{
-		k = i / j;
+		*size += n;
 
-		if (k == 0)
-		{
-			if (f)
-				putchar('0');
-		}
-		else
+		if (*size == capacity)
+			data = realloc(data, capacity *= 2);
+	}
+
+	if (!data)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return data;
+}
+
+size_t convert(const char *filename, int fd, int first, int last)
+{
+	struct stat sbuf;
+	void *data;
+	size_t size;
+	int mapped;
+
+	mapped = fstat(fd, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && sbuf.st_size > 0;
+
+	if (mapped)
+	{
+		size = sbuf.st_size;
+		data = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED)
 		{
-			i -= j * k;
-			f = 1;
-			putchar(hex[k]);
+			perror(filename);
+			exit(EXIT_FAILURE);
 		}
+
+		madvise(data, size, MADV_SEQUENTIAL);
 	}
+	else
+		data = read_all(fd, &size);
+
+	print_blocks(data, size / 4, first, last);
+
+	if (mapped)
+		munmap(data, size);
+	else
+		free(data);
+
+	return size;
 }
 
-int main()
-{
-	int b = 0, w, p = 0, t, n, pos = 0;
-
-	pos = 0;
-	printf("<html>\n");
-	printf("<link rel=stylesheet type=\"text/css\" href=\"colorforth.css\">\n");
-	printf("  <style type=\"text/css\">\n");
-	printf("  body { margin-right:10%%;}\n");
-	printf("  div.code {\n");
-	printf("    width:100%%;\n");
-	printf("    padding:0.5em;\n");
-	printf("    background-color:black;\n");
-	printf("    font-size:xx-large;\n");
-	printf("    font-weight:bold;\n");
-	printf("    text-transform:lowercase;\n");
-	printf("  }\n");
-	printf("  code.define { color:red; }\n");
-	printf("  code.compile { color:#00ff00; }\n");
-	printf("  code.compilehex { color:green; }\n");
-	printf("  code.execute { color:yellow; }\n");
-	printf("  code.executehex { color:#c0c000; }\n");
-	printf("  code.compilemacro { color:#00ffff; }\n");
-	printf("  code.variable {color:#ff00ff; }\n");
-	printf("  code.text { color:white; }\n");
-	printf("  code.textcapitalized { color:white; text-transform:capitalize; }\n");
-	printf("  code.textallcaps { color:white; text-transform:uppercase; }\n");
-	printf("  code.display_macro { color:#0000FF; }\n");
-	printf("  code.compiler_feedback { color:grey; }\n");
-	printf("  code.commented_number { color:white; }\n");
-	printf("  </style>\n");
-
-	if (fread(&t, 4, 1, stdin) == 0)
-		return 0;
-
-	pos = 4;
-
-	while (1)
-	{
-		printf("{block %d}\n", b++);
-		printf("<div class=code>\n");
-		w = 256;
-
-		while (w--)
+void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-b first[-last]] [-t] [blocks.cf...]\n"
+			"  -b  only convert these blocks\n"
+			"  -t  report the conversion speed\n",
+			program);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int first = 0, last = -1, timing = 0, option;
+	struct timespec start, end;
+	size_t total = 0;
+	char *range_end;
+	double seconds;
+
+	while ((option = getopt(argc, argv, "b:t")) != -1)
+	{
+		switch (option)
 		{
-			printf("<!-- pos: %d -->", pos);
+			case 'b':
+				first = last = strtol(optarg, &range_end, 10);
+				if (*range_end == '-')
+					last = strtol(range_end + 1, NULL, 10);
+				if (first < 0 || last < first)
+					usage(argv[0]);
+				break;
 
-			switch (t & 0xf)
-			{
-				case 0:
-					print_text(t & 0xfffffff0);
-					break;
-				case 2:
-				case 5:
-					print_tags(p, t & 0x1f);
-					if (w == 0)
-						break;
-					fread(&n, 4, 1, stdin);
-					pos += 4;
-					w--;
-					if (t & 0x10)
-						print_hex(n);
-					else
-						print_dec(n);
-					break;
-				case 6:
-				case 8:
-				case 0xf:
-					print_tags(p, t & 0x1f);
-					if (t & 0x10)
-						print_hex(t >> 5);
-					else
-						print_dec(t >> 5);
-					break;
-				case 0xc: // variable
-					print_tags(p, t & 0xf);
-					print_text(t & 0xfffffff0);
-					if (w == 0)
-						break;
-					fread(&t, 4, 1, stdin);
-					pos += 4;
-					w--;
-					print_tags(1, 4);
-					print_dec(t);
-					break;
-				default:
-					print_tags(p, t & 0xf);
-					print_text(t & 0xfffffff0);
-					break;
-			}
+			case 't':
+				timing = 1;
+				break;
+
+			default:
+				usage(argv[0]);
+		}
+	}
 
-			p = 1;
+	if (!(out = malloc(OUTPUT_SIZE)))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	build_decode_table();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	put_string(header);
 
-			if (fread(&t, 4, 1, stdin) == 0)
-			{
-				printf("</code>\n</div>\n");
-				goto end;
-			}
-			pos += 4;
+	if (optind == argc)
+		total += convert("stdin", STDIN_FILENO, first, last);
+
+	for (int i = optind; i < argc; i++)
+	{
+		int fd = open(argv[i], O_RDONLY);
+
+		if (fd == -1)
+		{
+			perror(argv[i]);
+			exit(EXIT_FAILURE);
 		}
-		if (p)
+
+		if (argc - optind > 1)
 		{
-			printf("</code>\n");
+			put_literal("<h2>");
+			put_string(argv[i]);
+			put_literal("</h2>\n");
 		}
-		p = 0;
-		printf("</div>\n<hr>\n");
+
+		total += convert(argv[i], fd, first, last);
+		close(fd);
 	}
-end:
-	printf("</html>\n");
+
+	put_literal("</html>\n");
+	flush_output();
+	free(out);
+
+	if (timing)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%zu bytes in, %zu bytes out, %.6f s, %.1f MB/s\n",
+				total, out_total, seconds, total / seconds / 1e6);
+	}
+
 	return 0;
 }
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Convert the blocks.txt tag syntax to blocks.cf and back, in one pass.
+ * Replaces tools/colorforth_block_tool.py, packing is shared with the
+ * interpreter. Also converts blocks.cf to the indexed block store
+ * container, compressed with -z, and checks containers.
+ *
+ * Blocks don't keep the layout of the text: totext starts a line at each
+ * definition only. Converting blocks to text and back gives the same
+ * blocks byte for byte, text to blocks and back gives the same words.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include "../colorforth.h"
+
+#define PARAM_MAX	256
+
+static const char *functions[] = {
+	"extension", "execute", "executelong", "define",
+	"compileword", "compilelong", "compileshort", "compilemacro",
+	"executeshort", "text", "textcapitalized", "textallcaps",
+	"variable", "compiler_feedback", "display_macro", "commented_number"
+};
+
+static void
+fail(const char *message, const char *detail)
+{
+	fprintf(stderr, "Error: %s%s%s\n", message, detail ? ": " : "",
+			detail ? detail : "");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Text to blocks
+ */
+struct block_writer
+{
+	FILE    *out;
+	cell_t   cells[BLOCK_CELLS];
+	int      nb_cells;
+	bool     is_open;
+	bool     in_variable;
+};
+
+static void
+emit_cell(struct block_writer *writer, const cell_t cell)
+{
+	if (writer->nb_cells == BLOCK_CELLS)
+		fail("block has more than 256 cells", NULL);
+
+	writer->cells[writer->nb_cells++] = cell;
+}
+
+static void
+flush_block(struct block_writer *writer)
+{
+	if (!writer->is_open)
+		return;
+
+	memset(&writer->cells[writer->nb_cells], 0,
+		(BLOCK_CELLS - writer->nb_cells) * sizeof(cell_t));
+
+	if (fwrite(writer->cells, sizeof(cell_t), BLOCK_CELLS, writer->out)
+			!= BLOCK_CELLS)
+		fail("cannot write block", NULL);
+
+	writer->nb_cells = 0;
+}
+
+static void
+emit_text(struct block_writer *writer, const cell_t tag, const char *text)
+{
+	cell_t cells[BLOCK_CELLS];
+	int nb_cells = pack_word(text, cells, BLOCK_CELLS);
+
+	if (nb_cells == -1)
+		fail("character not allowed in a word", text);
+
+	for (int i = 0; i < nb_cells; i++)
+		emit_cell(writer, cells[i] | (i ? 0 : tag));
+}
+
+static int
+function_tag(const char *name)
+{
+	bool is_hex = !strncmp(name, "hex_", 4);
+
+	if (is_hex)
+		name += 4;
+
+	for (int i = 0; i < 16; i++)
+		if (!strcmp(name, functions[i]))
+			return i | (is_hex ? 0x10 : 0);
+
+	return -1;
+}
+
+static void
+emit_function(struct block_writer *writer, const char *name, const char *param)
+{
+	int tag = function_tag(name);
+	int base = tag & 0xf;
+	unsigned long number;
+
+	if (tag == -1 || !writer->is_open)
+		fail(tag == -1 ? "unknown function" : "function outside a block", name);
+
+	if (base == 5 || base == 2) // compilelong, executelong
+	{
+		number = strtoul(param, NULL, (tag & 0x10) ? 16 : 10);
+		emit_cell(writer, tag);
+		emit_cell(writer, number);
+	}
+	else if (base == 6 || base == 8 || base == 15) // short numbers
+	{
+		number = strtol(param, NULL, (tag & 0x10) ? 16 : 10);
+		emit_cell(writer, (cell_t)(((uint32_t)number << 5) + tag));
+	}
+	else if (base == 4 && writer->in_variable)
+	{
+		// A variable's value follows it as a plain cell
+		emit_cell(writer, strtol(param, NULL, 10));
+		writer->in_variable = false;
+	}
+	else
+	{
+		if (base == 12)
+			writer->in_variable = true;
+
+		emit_text(writer, tag, param);
+	}
+}
+
+static void
+text_to_blocks(FILE *in, FILE *out)
+{
+	struct block_writer writer = {.out = out};
+	char name[32], param[PARAM_MAX];
+	int c;
+
+	while ((c = getc(in)) != EOF)
+	{
+		size_t n = 0;
+
+		if (isspace(c))
+			continue;
+
+		if (c == '{')
+		{
+			// {block n}, blocks follow each other in order
+			while ((c = getc(in)) != EOF && c != '}')
+				;
+
+			flush_block(&writer);
+			writer.is_open = true;
+			continue;
+		}
+
+		do
+		{
+			if (n == sizeof(name) - 1)
+				fail("function name too long", NULL);
+			name[n++] = c;
+		} while ((c = getc(in)) != EOF && c != '(');
+
+		name[n] = '\0';
+		n = 0;
+
+		while ((c = getc(in)) != EOF && c != ')')
+		{
+			if (n == sizeof(param) - 1)
+				fail("parameter too long", name);
+			param[n++] = c;
+		}
+
+		param[n] = '\0';
+
+		if (c == EOF)
+			fail("unterminated function", name);
+
+		emit_function(&writer, name, param);
+	}
+
+	flush_block(&writer);
+}
+
+/*
+ * Blocks to text
+ */
+static void
+print_number(FILE *out, const cell_t number, const bool is_hex)
+{
+	if (is_hex)
+		fprintf(out, "%x", (uint32_t)number);
+	else
+		fprintf(out, "%d", number);
+}
+
+static void
+print_function(FILE *out, const bool is_first, const int tag)
+{
+	if (!is_first)
+		fputs((tag & 0xf) == 3 ? ")\n" : ") ", out);
+
+	fprintf(out, "%s%s(", (tag & 0x10) ? "hex_" : "", functions[tag & 0xf]);
+}
+
+static void
+print_block(FILE *out, const cell_t *cells)
+{
+	bool is_first = true;
+
+	for (int pos = 0; pos < BLOCK_CELLS; pos++)
+	{
+		cell_t cell = cells[pos];
+		int tag = cell & 0xf;
+
+		if (cell == 0)
+			continue;
+
+		switch (tag)
+		{
+			case 0:
+				fputs(unpack(cell), out);
+				continue;
+
+			case 2:
+			case 5:
+				print_function(out, is_first, cell & 0x1f);
+				if (pos < BLOCK_CELLS - 1)
+					print_number(out, cells[++pos], cell & 0x10);
+				break;
+
+			case 6:
+			case 8:
+			case 0xf:
+				print_function(out, is_first, cell & 0x1f);
+				if (cell & 0x10)
+					print_number(out, (uint32_t)cell >> 5, true);
+				else
+					print_number(out, cell >> 5, false);
+				break;
+
+			case 0xc:
+				print_function(out, is_first, tag);
+				fputs(unpack(cell), out);
+				if (pos < BLOCK_CELLS - 1)
+				{
+					print_function(out, false, 4);
+					print_number(out, cells[++pos], false);
+				}
+				break;
+
+			default:
+				print_function(out, is_first, tag);
+				fputs(unpack(cell), out);
+				break;
+		}
+
+		is_first = false;
+	}
+
+	if (!is_first)
+		fputs(")\n", out);
+}
+
+static void
+blocks_to_text(FILE *out)
+{
+	cell_t cells[BLOCK_CELLS];
+	const cell_t *block;
+	unsigned int nb_cells;
+
+	for (cell_t n = 0; n < block_count(); n++)
+	{
+		block = block_cells(n, &nb_cells);
+		memcpy(cells, block, nb_cells * sizeof(cell_t));
+		memset(&cells[nb_cells], 0, (BLOCK_CELLS - nb_cells) * sizeof(cell_t));
+
+		fprintf(out, "{block %d}\n", n);
+		print_block(out, cells);
+	}
+}
+
+/*
+ * Block store
+ */
+static cell_t *
+padded_blocks(void)
+{
+	cell_t *cells = calloc((size_t)block_count() * BLOCK_CELLS + 1, sizeof(cell_t));
+	const cell_t *block;
+	unsigned int nb_cells;
+
+	if (!cells)
+		fail("not enough memory", NULL);
+
+	for (cell_t n = 0; n < block_count(); n++)
+	{
+		block = block_cells(n, &nb_cells);
+		memcpy(&cells[(size_t)n * BLOCK_CELLS], block, nb_cells * sizeof(cell_t));
+	}
+
+	return cells;
+}
+
+static int
+check_blocks(const char *path)
+{
+	int nb_corrupted = 0;
+
+	for (cell_t n = 0; n < block_count(); n++)
+		if (block_verify(n) == -1)
+			nb_corrupted++;
+
+	printf("%s: %d blocks, %d corrupted, content hash %016" PRIx64 "\n",
+			path, block_count(), nb_corrupted, block_store_hash());
+
+	return nb_corrupted ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void
+usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s tocf blocks.txt blocks.cf\n"
+			"       %s totext blocks.cf blocks.txt\n"
+			"       %s container [-z] blocks.cf blocks.cfc\n"
+			"       %s raw blocks.cfc blocks.cf\n"
+			"       %s check blocks.cfc\n"
+			"totext starts a line at each definition only, blocks.cf\n"
+			"converted to text and back is the same byte for byte.\n",
+			program, program, program, program, program);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *command = argc > 1 ? argv[1] : "";
+	cell_t *cells;
+	FILE *in, *out;
+	bool compress = false;
+	int status;
+
+	if (!strcmp(command, "check") && argc == 3)
+	{
+		if (block_store_open(argv[2]) == -1)
+			return EXIT_FAILURE;
+
+		status = check_blocks(argv[2]);
+		block_store_close();
+
+		return status;
+	}
+
+	if (!strcmp(command, "container") && argc == 5 && !strcmp(argv[2], "-z"))
+	{
+		compress = true;
+		argv++;
+		argc--;
+	}
+
+	if (argc != 4)
+		usage(argv[0]);
+
+	if (!strcmp(command, "tocf"))
+	{
+		if (!(in = fopen(argv[2], "r")))
+		{
+			perror(argv[2]);
+			return EXIT_FAILURE;
+		}
+
+		if (!(out = fopen(argv[3], "wb")))
+		{
+			perror(argv[3]);
+			return EXIT_FAILURE;
+		}
+
+		text_to_blocks(in, out);
+		fclose(in);
+	}
+	else if (!strcmp(command, "totext") || !strcmp(command, "container")
+			|| !strcmp(command, "raw"))
+	{
+		// Raw files and containers are both read through the block store
+		if (block_store_open(argv[2]) == -1)
+			return EXIT_FAILURE;
+
+		if (!strcmp(command, "container"))
+		{
+			cells = padded_blocks();
+			status = block_store_save(argv[3], cells, block_count(), compress);
+			free(cells);
+			block_store_close();
+
+			return status == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+		}
+
+		if (!(out = fopen(argv[3], "wb")))
+		{
+			perror(argv[3]);
+			return EXIT_FAILURE;
+		}
+
+		if (!strcmp(command, "totext"))
+			blocks_to_text(out);
+		else
+		{
+			cells = padded_blocks();
+			fwrite(cells, sizeof(cell_t) * BLOCK_CELLS, block_count(), out);
+			free(cells);
+		}
+
+		block_store_close();
+	}
+	else
+		usage(argv[0]);
+
+	if (fclose(out) == EOF)
+	{
+		perror(argv[3]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Checks cfblock against the Python block tool on a block text file.
+#
+# Both convert the text to blocks, which must be the same byte for byte.
+# Blocks don't keep the layout of the text, so only the way back from
+# blocks is byte for byte: the text cfblock writes for them must convert
+# to the same blocks again, with both tools. The Python tool can't write
+# text itself.
+#
+# Usage: tools/roundtrip.sh [blocks.txt]
+# PYTHON names a Python 2 with pyparsing, python2 by default.
+
+text=${1:-blocks/blocks.txt}
+python=${PYTHON:-python2}
+tools=$(dirname "$0")
+dir=$(mktemp -d) || exit 1
+
+trap 'rm -rf "$dir"' EXIT
+
+# Converts $1 with both tools to $2.c.cf and $2.py.cf and compares them
+both() {
+	"$tools/cfblock" tocf "$1" "$2.c.cf" >/dev/null &&
+	"$python" "$tools/colorforth_block_tool.py" tocf "$1" "$2.py.cf" &&
+	cmp "$2.c.cf" "$2.py.cf"
+}
+
+both "$text" "$dir/text" || exit 1
+"$tools/cfblock" totext "$dir/text.c.cf" "$dir/back.txt" >/dev/null || exit 1
+both "$dir/back.txt" "$dir/back" || exit 1
+cmp "$dir/text.c.cf" "$dir/back.c.cf" || exit 1
+
+echo "$text: cfblock and $python write the same blocks, which convert" \
+	"to text and back byte for byte"
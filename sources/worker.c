@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Interpreter thread
+ *
+ * The editor hands the words typed at the prompt to a thread running the
+ * interpreter, through a single producer single consumer queue, and gets
+ * back snapshots of the stack. It keeps drawing and reading keys while a
+ * word runs, and can interrupt it. Between words, the thread reloads the
+ * block file when it changes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "colorforth.h"
+
+#define QUEUE_SIZE   64		// Words typed ahead, a power of two
+#define WATCH_PERIOD 100	// ms between checks of the block file
+
+#define INTERPRET_WORD_TAG 1
+
+static cell_t       queue[QUEUE_SIZE];
+static unsigned int queue_head;		// Written by the editor only
+static unsigned int queue_tail;		// Written by the interpreter only
+static sem_t        queue_items;
+
+static pthread_t        thread;
+static pthread_rwlock_t blocks_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile int     is_running;
+static volatile int     is_busy;
+
+// Taken by the editor, or replaced by the next one, under published_lock
+static struct worker_snapshot *published;
+static pthread_mutex_t         published_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*published_callback)(void);
+
+static cell_t *changed_blocks;
+static size_t  nb_changed_blocks;
+static size_t  changed_blocks_size;
+
+static void
+publish(const bool is_word_missing, const bool are_blocks_changed)
+{
+	struct worker_snapshot *snapshot = malloc(sizeof(*snapshot));
+	struct worker_snapshot *previous;
+
+	if (!snapshot)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	snapshot->stack = dot_s();
+
+	pthread_mutex_lock(&published_lock);
+	previous = published;
+
+	// Keep what the editor didn't see yet from the snapshot it didn't take
+	snapshot->is_word_missing    = is_word_missing
+		|| (previous && previous->is_word_missing);
+	snapshot->are_blocks_changed = are_blocks_changed
+		|| (previous && previous->are_blocks_changed);
+
+	published = snapshot;
+	pthread_mutex_unlock(&published_lock);
+
+	worker_snapshot_free(previous);
+
+	if (published_callback)
+		published_callback();
+}
+
+static bool
+run_word(const cell_t word)
+{
+	if ((word & 0xf) == INTERPRET_WORD_TAG && !lookup_word(word, FORTH_DICTIONARY))
+		return false;
+
+	do_word(word);
+
+	return true;
+}
+
+static void
+remember_changed_block(const cell_t n)
+{
+	if (nb_changed_blocks == changed_blocks_size)
+	{
+		changed_blocks_size = changed_blocks_size ? changed_blocks_size * 2 : 16;
+		changed_blocks = realloc(changed_blocks,
+				changed_blocks_size * sizeof(cell_t));
+
+		if (!changed_blocks)
+		{
+			fprintf(stderr, "Error: Not enough memory!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	changed_blocks[nb_changed_blocks++] = n;
+}
+
+// Blocks are remapped while the editor doesn't read them, then recompiled
+static bool
+reload_changed_blocks(void)
+{
+	int nb_changed;
+
+	nb_changed_blocks = 0;
+
+	pthread_rwlock_wrlock(&blocks_lock);
+	nb_changed = block_store_poll(remember_changed_block);
+	pthread_rwlock_unlock(&blocks_lock);
+
+	for (size_t i = 0; i < nb_changed_blocks; i++)
+		reload_block(changed_blocks[i]);
+
+	return nb_changed > 0;
+}
+
+static void *
+interpreter(void *unused)
+{
+	struct timespec deadline;
+	cell_t word;
+	bool is_found;
+
+	(void)unused;
+
+	while (is_running)
+	{
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += WATCH_PERIOD * 1000000L;
+		deadline.tv_sec  += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		if (sem_timedwait(&queue_items, &deadline) == -1)
+		{
+			if (reload_changed_blocks())
+				publish(false, true);
+
+			continue;
+		}
+
+		if (!is_running)
+			break;
+
+		word = queue[queue_tail % QUEUE_SIZE];
+		__atomic_store_n(&queue_tail, queue_tail + 1, __ATOMIC_RELEASE);
+
+		is_busy  = 1;
+		is_found = run_word(word);
+		is_busy  = 0;
+
+		publish(!is_found, false);
+	}
+
+	return NULL;
+}
+
+/*
+ * Called from the editor
+ */
+int
+worker_start(void (*callback)(void))
+{
+	published_callback = callback;
+	is_running = 1;
+
+	block_store_watch();
+
+	if (sem_init(&queue_items, 0, 0) == -1
+			|| pthread_create(&thread, NULL, interpreter, NULL) != 0)
+	{
+		fprintf(stderr, "Error: cannot start the interpreter thread!\n");
+		is_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+worker_stop(void)
+{
+	is_running = 0;
+	colorforth_interrupt();
+	sem_post(&queue_items);
+	pthread_join(thread, NULL);
+	sem_destroy(&queue_items);
+
+	block_store_unwatch();
+	worker_snapshot_free(worker_snapshot());
+	free(changed_blocks);
+	changed_blocks = NULL;
+	nb_changed_blocks = changed_blocks_size = 0;
+}
+
+// Queue a word typed at the prompt, -1 when too many are waiting
+int
+worker_submit(const cell_t word)
+{
+	unsigned int head = queue_head;
+
+	if (head - __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE)
+		return -1;
+
+	queue[head % QUEUE_SIZE] = word;
+	__atomic_store_n(&queue_head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&queue_items);
+
+	return 0;
+}
+
+bool
+worker_is_busy(void)
+{
+	return is_busy;
+}
+
+// Latest snapshot if there is a new one, to release with worker_snapshot_free()
+struct worker_snapshot *
+worker_snapshot(void)
+{
+	struct worker_snapshot *snapshot;
+
+	pthread_mutex_lock(&published_lock);
+	snapshot  = published;
+	published = NULL;
+	pthread_mutex_unlock(&published_lock);
+
+	return snapshot;
+}
+
+void
+worker_snapshot_free(struct worker_snapshot *snapshot)
+{
+	if (!snapshot)
+		return;
+
+	free(snapshot->stack);
+	free(snapshot);
+}
+
+// Around reading blocks from the editor, while the thread may reload them
+void
+worker_lock_blocks(void)
+{
+	pthread_rwlock_rdlock(&blocks_lock);
+}
+
+void
+worker_unlock_blocks(void)
+{
+	pthread_rwlock_unlock(&blocks_lock);
+}
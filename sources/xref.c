@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2017 Konstantin Tcholokachvili
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Cross references
+ *
+ * Where each word is defined and used in the blocks: a hash table from a
+ * name, without its color as lookup_word() compares them, to the cells
+ * naming it in block order. It is built the first time it is asked, in
+ * one pass over the block store, then the blocks the store reports as
+ * changed are indexed again.
+ *
+ * The interpreter thread and the editor both ask, the index has its own
+ * lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "colorforth.h"
+
+#define XREF_TABLE_MIN 1024	// Slots, a power of two
+
+struct xref_entry
+{
+	cell_t                name;		// 0 for a free slot
+	struct xref_location *locations;	// By block then cell
+	unsigned int          nb_locations;
+	unsigned int          size;
+};
+
+// Names indexed in a block, to take them out when it changes
+struct block_names
+{
+	cell_t       *names;
+	unsigned int  nb_names;
+};
+
+static struct xref_entry  *table;
+static size_t              table_size;
+static size_t              nb_entries;
+static struct block_names *blocks;
+static cell_t              nb_blocks;
+static bool                is_built;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *
+xref_realloc(void *pointer, const size_t size)
+{
+	if (!(pointer = realloc(pointer, size)))
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return pointer;
+}
+
+// Execute, define, compile, compile macro and variable name words
+static bool
+is_word_tag(const unsigned int tag)
+{
+	return tag == 1 || tag == 3 || tag == 4 || tag == 7 || tag == 0xc;
+}
+
+static size_t
+slot_of(const cell_t name, const size_t size)
+{
+	return ((uint32_t)name >> 4) * 2654435761u & (size - 1);
+}
+
+static void
+table_grow(void)
+{
+	struct xref_entry *previous = table;
+	size_t previous_size = table_size;
+	size_t slot;
+
+	table_size = table_size ? table_size * 2 : XREF_TABLE_MIN;
+	table = calloc(table_size, sizeof(struct xref_entry));
+
+	if (!table)
+	{
+		fprintf(stderr, "Error: Not enough memory!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < previous_size; i++)
+	{
+		if (!previous[i].name)
+			continue;
+
+		slot = slot_of(previous[i].name, table_size);
+		while (table[slot].name)
+			slot = (slot + 1) & (table_size - 1);
+
+		table[slot] = previous[i];
+	}
+
+	free(previous);
+}
+
+static struct xref_entry *
+entry_of(const cell_t name, const bool is_added)
+{
+	size_t slot;
+
+	if (is_added && (nb_entries + 1) * 2 > table_size)
+		table_grow();
+
+	if (!table)
+		return NULL;
+
+	for (slot = slot_of(name, table_size); table[slot].name;
+			slot = (slot + 1) & (table_size - 1))
+	{
+		if (table[slot].name == name)
+			return &table[slot];
+	}
+
+	if (!is_added)
+		return NULL;
+
+	table[slot].name = name;
+	nb_entries++;
+
+	return &table[slot];
+}
+
+static void
+location_add(struct xref_entry *entry, const cell_t n, const unsigned int cell,
+		const unsigned int tag)
+{
+	unsigned int i = entry->nb_locations;
+
+	if (entry->nb_locations == entry->size)
+	{
+		entry->size = entry->size ? entry->size * 2 : 4;
+		entry->locations = xref_realloc(entry->locations,
+				entry->size * sizeof(struct xref_location));
+	}
+
+	// Blocks are mostly indexed in order, a changed one goes in its place
+	while (i > 0 && entry->locations[i - 1].block > n)
+		i--;
+
+	memmove(&entry->locations[i + 1], &entry->locations[i],
+			(entry->nb_locations - i) * sizeof(struct xref_location));
+
+	entry->locations[i] = (struct xref_location){.block = n, .cell = cell,
+		.tag = tag};
+	entry->nb_locations++;
+}
+
+static void
+block_forget(const cell_t n)
+{
+	struct block_names *names = &blocks[n];
+	struct xref_entry *entry;
+	unsigned int kept;
+
+	for (unsigned int i = 0; i < names->nb_names; i++)
+	{
+		if (!(entry = entry_of(names->names[i], false)))
+			continue;
+
+		kept = 0;
+		for (unsigned int j = 0; j < entry->nb_locations; j++)
+			if (entry->locations[j].block != n)
+				entry->locations[kept++] = entry->locations[j];
+
+		entry->nb_locations = kept;
+	}
+
+	free(names->names);
+	names->names    = NULL;
+	names->nb_names = 0;
+}
+
+/*
+ * Cells are read the way the editor splits them in words: extension
+ * cells follow a long name, a value cell follows a variable and a long
+ * number.
+ */
+static void
+block_index(const cell_t n)
+{
+	struct block_names *names = &blocks[n];
+	unsigned int nb_cells, tag, size = 0;
+	const cell_t *cells = block_cells(n, &nb_cells);
+	cell_t name;
+
+	for (unsigned int i = 0; i < nb_cells; i++)
+	{
+		tag  = cells[i] & 0xf;
+		name = cells[i] & 0xfffffff0;
+
+		if (tag == 2 || tag == 5)
+		{
+			i++;
+			continue;
+		}
+
+		if (is_word_tag(tag) && name)
+		{
+			location_add(entry_of(name, true), n, i, tag);
+
+			if (names->nb_names == size)
+			{
+				size = size ? size * 2 : 16;
+				names->names = xref_realloc(names->names, size * sizeof(cell_t));
+			}
+
+			names->names[names->nb_names++] = name;
+		}
+
+		while (i + 1 < nb_cells && cells[i + 1] && !(cells[i + 1] & 0xf))
+			i++;
+
+		if (tag == 0xc)
+			i++;
+	}
+}
+
+static void
+blocks_resize(const cell_t count)
+{
+	if (count <= nb_blocks)
+		return;
+
+	blocks = xref_realloc(blocks, count * sizeof(struct block_names));
+	memset(&blocks[nb_blocks], 0, (count - nb_blocks) * sizeof(struct block_names));
+	nb_blocks = count;
+}
+
+static void
+build(void)
+{
+	blocks_resize(block_count());
+
+	for (cell_t n = 0; n < nb_blocks; n++)
+		block_index(n);
+
+	is_built = true;
+}
+
+/*
+ * Called by the block store
+ */
+void
+xref_update(const cell_t n)
+{
+	pthread_mutex_lock(&lock);
+
+	if (is_built && n >= 0)
+	{
+		blocks_resize(n + 1);
+		block_forget(n);
+		block_index(n);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void
+xref_clear(void)
+{
+	pthread_mutex_lock(&lock);
+
+	for (size_t i = 0; i < table_size; i++)
+		free(table[i].locations);
+
+	for (cell_t n = 0; n < nb_blocks; n++)
+		free(blocks[n].names);
+
+	free(table);
+	free(blocks);
+	table      = NULL;
+	blocks     = NULL;
+	table_size = nb_entries = 0;
+	nb_blocks  = 0;
+	is_built   = false;
+
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Cells naming the word, in block order, to release with free(). The
+ * editor holds the blocks while it asks.
+ */
+struct xref_location *
+xref_find(const cell_t word, unsigned int *nb_locations)
+{
+	struct xref_location *locations = NULL;
+	struct xref_entry *entry;
+
+	pthread_mutex_lock(&lock);
+
+	if (!is_built)
+		build();
+
+	*nb_locations = 0;
+
+	if ((entry = entry_of(word & 0xfffffff0, false)) && entry->nb_locations)
+	{
+		locations = xref_realloc(NULL,
+				entry->nb_locations * sizeof(struct xref_location));
+		memcpy(locations, entry->locations,
+				entry->nb_locations * sizeof(struct xref_location));
+		*nb_locations = entry->nb_locations;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return locations;
+}